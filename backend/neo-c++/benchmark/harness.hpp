@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <prelude/memory.hpp>
+
+/* A small harness for benchmarks of the runtime, in the style of nanobench.
+ * Each benchmark is timed in batches, which are grown until one takes long
+ * enough to time, and the median batch is reported. People get a table on
+ * stderr; tools get one JSON object per benchmark, per line, on stdout. */
+namespace jank::benchmark
+{
+  /* Keeps a value, and everything which went into it, from being optimized
+   * out. */
+  template <typename T>
+  void keep(T const &value)
+  { asm volatile("" : : "r"(&value) : "memory"); }
+
+  class runner
+  {
+    public:
+      using clock_type = std::chrono::steady_clock;
+
+      /* JANK_BENCHMARK_FILTER only runs the benchmarks whose names contain
+       * it. */
+      explicit runner(std::string s)
+        : suite{ std::move(s) }
+      {
+        if(auto const * const env = std::getenv("JANK_BENCHMARK_FILTER"))
+        { filter = env; }
+      }
+
+      /* Times calls of f, which does one operation each time. */
+      template <typename F>
+      void run(std::string const &name, F &&f)
+      {
+        if(name.find(filter) == std::string::npos)
+        { return; }
+
+        /* Also warms up the caches and the heap. */
+        size_t iterations{ 1 };
+        while(time(f, iterations) < min_batch_time && iterations < max_iterations)
+        { iterations *= 2; }
+
+#ifdef JANK_ALLOCATION_STATS
+        auto const allocations_before(detail::allocation_stats::instance().allocations.load());
+#endif
+        std::vector<double> ns_per_op;
+        for(size_t i{}; i < batches; ++i)
+        {
+          std::chrono::duration<double, std::nano> const ns{ time(f, iterations) };
+          ns_per_op.push_back(ns.count() / iterations);
+        }
+        std::sort(ns_per_op.begin(), ns_per_op.end());
+
+        std::cerr << suite << " " << name << ": "
+                  << ns_per_op[ns_per_op.size() / 2] << " ns/op" << std::endl;
+        std::cout << "{\"suite\": \"" << escape(suite) << "\""
+                  << ", \"name\": \"" << escape(name) << "\""
+                  << ", \"unit\": \"ns/op\""
+                  << ", \"median\": " << ns_per_op[ns_per_op.size() / 2]
+                  << ", \"min\": " << ns_per_op.front()
+                  << ", \"max\": " << ns_per_op.back()
+                  << ", \"iterations\": " << iterations
+                  << ", \"batches\": " << batches;
+#ifdef JANK_ALLOCATION_STATS
+        auto const allocations
+        (detail::allocation_stats::instance().allocations.load() - allocations_before);
+        std::cout << ", \"allocations/op\": "
+                  << (static_cast<double>(allocations) / (iterations * batches));
+#endif
+        std::cout << "}" << std::endl;
+      }
+
+    private:
+      static std::chrono::nanoseconds constexpr min_batch_time{ std::chrono::milliseconds{ 10 } };
+      static size_t constexpr max_iterations{ size_t{ 1 } << 30 };
+      static size_t constexpr batches{ 11 };
+
+      template <typename F>
+      static clock_type::duration time(F &f, size_t const iterations)
+      {
+        auto const start(clock_type::now());
+        for(size_t i{}; i < iterations; ++i)
+        { keep(f()); }
+        return clock_type::now() - start;
+      }
+
+      static std::string escape(std::string const &s)
+      {
+        std::string ret;
+        for(auto const c : s)
+        {
+          if(c == '"' || c == '\\')
+          { ret += '\\'; }
+          ret += c;
+        }
+        return ret;
+      }
+
+      std::string suite;
+      std::string filter;
+  };
+}
@@ -0,0 +1,174 @@
+/* Compares collecting garbage against counting references, both atomically
+ * and not: throughput, the longest pause, and peak RSS. Build it each way from
+ * the repo root and compare the output:
+ *
+ *   c++ -O2 -std=c++17 -pthread -I backend/neo-c++/include -I lib/immer \
+ *     -o memory-rc backend/neo-c++/benchmark/memory.cpp
+ *   c++ -O2 -std=c++17 -pthread -DJANK_SINGLE_THREADED -I backend/neo-c++/include \
+ *     -I lib/immer -o memory-st backend/neo-c++/benchmark/memory.cpp
+ *   c++ -O2 -std=c++17 -pthread -DJANK_GC -I backend/neo-c++/include -I lib/immer \
+ *     -o memory-gc backend/neo-c++/benchmark/memory.cpp -lgc -lgccpp
+ *
+ * When counting references, freeing happens all at once, as the last
+ * reference is dropped, so the pause is the longest it takes to drop a
+ * structure. When collecting, it's the longest collection.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <prelude.hpp>
+
+namespace
+{
+  using clock_type = std::chrono::steady_clock;
+
+  jank::detail::integer constexpr count{ 1 << 20 };
+  double longest_pause_ms{};
+
+  void pause(clock_type::time_point const start)
+  {
+    std::chrono::duration<double, std::milli> const ms{ clock_type::now() - start };
+    longest_pause_ms = std::max(longest_pause_ms, ms.count());
+  }
+
+#ifdef JANK_GC
+  clock_type::time_point collection_start;
+  void on_collection_event(GC_EventType const event)
+  {
+    if(event == GC_EVENT_START)
+    { collection_start = clock_type::now(); }
+    else if(event == GC_EVENT_END)
+    { pause(collection_start); }
+  }
+#endif
+
+  /* Drops the only reference to a structure. */
+  void drop(jank::object &o)
+  {
+    auto const start(clock_type::now());
+    o = jank::JANK_NIL;
+    if(!jank::detail::garbage_collected)
+    { pause(start); }
+  }
+
+  template <typename F>
+  void measure(char const * const name, F const &f)
+  {
+    auto const start(clock_type::now());
+    auto const result(f());
+    std::chrono::duration<double, std::nano> const ns{ clock_type::now() - start };
+
+    /* Printing the result keeps the work from being optimized out. */
+    std::cout << name << ": " << (ns.count() / count) << " ns/element ("
+              << result << ")" << std::endl;
+  }
+}
+
+int main()
+{
+  using namespace jank;
+
+#ifdef JANK_GC
+  GC_INIT();
+  GC_set_on_collection_event(&on_collection_event);
+  std::cout << "memory: collected" << std::endl;
+#elif defined(JANK_SINGLE_THREADED)
+  std::cout << "memory: reference counted, single threaded" << std::endl;
+#else
+  std::cout << "memory: reference counted" << std::endl;
+#endif
+
+  measure
+  (
+    "copy objects",
+    []
+    {
+      /* Nothing but counting. */
+      object const v{ JANK_VECTOR(object{ 0 }, object{ 1 }, object{ 2 }) };
+      std::vector<object> copies(16);
+      size_t ret{};
+      for(detail::integer i{}; i < count; ++i)
+      {
+        copies[i % copies.size()] = v;
+        ret += copies[(i * 7) % copies.size()].get_kind() == object::kind::vector;
+      }
+      return ret;
+    }
+  );
+
+  measure
+  (
+    "short-lived vectors",
+    []
+    {
+      size_t ret{};
+      for(detail::integer i{}; i < count; ++i)
+      {
+        auto const v(JANK_VECTOR(object{ i }, object{ i + 1 }, object{ i + 2 }, object{ i + 3 }));
+        ret += v.expect<detail::vector>().size();
+      }
+      return ret;
+    }
+  );
+
+  measure
+  (
+    "copy collections",
+    []
+    {
+      object const v{ JANK_VECTOR(object{ 0 }, object{ 1 }, object{ 2 }) };
+      detail::vector_transient copies;
+      for(detail::integer i{}; i < count; ++i)
+      { copies.push_back(v); }
+      object all{ copies.persistent() };
+      auto const ret(all.expect<detail::vector>().size());
+      drop(all);
+      return ret;
+    }
+  );
+
+  measure
+  (
+    "persistent updates",
+    []
+    {
+      /* A large live set, with most of each version shared with the last. */
+      object m{ JANK_MAP() };
+      for(detail::integer i{}; i < count; ++i)
+      { m = assoc(m, object{ i % (count / 8) }, object{ i }); }
+      auto const ret(m.expect<detail::map>().size());
+      drop(m);
+      return ret;
+    }
+  );
+
+  measure
+  (
+    "nested vectors",
+    []
+    {
+      object outer{ JANK_VECTOR() };
+      for(detail::integer i{}; i < count / 16; ++i)
+      {
+        auto inner
+        (
+          JANK_VECTOR
+          (object{ i }, JANK_VECTOR(object{ i }), JANK_MAP(JANK_MAP_ENTRY(object{ i }, object{ i })))
+        );
+        outer = conj(outer, std::move(inner));
+      }
+      auto const ret(outer.expect<detail::vector>().size());
+      drop(outer);
+      return ret;
+    }
+  );
+
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  std::cout << "longest pause: " << longest_pause_ms << " ms" << std::endl;
+  std::cout << "peak rss: " << usage.ru_maxrss << " KiB" << std::endl;
+}
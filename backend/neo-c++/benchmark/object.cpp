@@ -0,0 +1,142 @@
+/* Measures the size of objects, how many allocations common operations make,
+ * and how long they take. Build from the repo root with:
+ *
+ *   c++ -O2 -std=c++17 -pthread -I backend/neo-c++/include -I lib/immer \
+ *     -o object backend/neo-c++/benchmark/object.cpp
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include <prelude.hpp>
+
+namespace
+{
+  std::atomic<size_t> allocations{};
+}
+
+void* operator new(size_t const size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if(auto * const p = std::malloc(size))
+  { return p; }
+  throw std::bad_alloc{};
+}
+void operator delete(void * const p) noexcept
+{ std::free(p); }
+void operator delete(void * const p, size_t) noexcept
+{ std::free(p); }
+
+namespace
+{
+  jank::detail::integer constexpr count{ 1 << 20 };
+
+  template <typename F>
+  void measure(char const * const name, F const &f)
+  {
+    auto const before(allocations.load());
+    auto const start(std::chrono::steady_clock::now());
+    auto const result(f());
+    auto const end(std::chrono::steady_clock::now());
+    auto const ns(std::chrono::duration<double, std::nano>(end - start).count());
+
+    /* Printing the result keeps the work from being optimized out. */
+    std::cout << name << ": " << (ns / count) << " ns/element, "
+              << (static_cast<double>(allocations.load() - before) / count)
+              << " allocations/element (" << result << ")" << std::endl;
+  }
+}
+
+int main()
+{
+  using namespace jank;
+
+  std::cout << "sizeof(object): " << sizeof(object) << std::endl;
+
+  object const reals
+  {
+    []
+    {
+      detail::vector_transient ret;
+      for(detail::integer i{}; i < count; ++i)
+      { ret.push_back(object{ static_cast<detail::real>(i) }); }
+      return ret.persistent();
+    }()
+  };
+
+  measure
+  (
+    "build vector",
+    []
+    {
+      detail::vector_transient ret;
+      for(detail::integer i{}; i < count; ++i)
+      { ret.push_back(object{ i }); }
+      return object{ ret.persistent() }.expect<detail::vector>().size();
+    }
+  );
+
+  measure
+  (
+    "map literal",
+    []
+    {
+      size_t ret{};
+      for(detail::integer i{}; i < count; ++i)
+      {
+        auto const m
+        (
+          JANK_MAP
+          (
+            JANK_MAP_ENTRY(object{ 0 }, object{ i }),
+            JANK_MAP_ENTRY(object{ 1 }, object{ i }),
+            JANK_MAP_ENTRY(object{ 2 }, object{ i })
+          )
+        );
+        ret += m.expect<detail::map>().size();
+      }
+      return ret;
+    }
+  );
+
+  measure
+  (
+    "copy objects",
+    [&]
+    {
+      size_t ret{};
+      for(object const &e : reals.expect<detail::vector>())
+      {
+        object const copy{ e };
+        ret += copy.get_kind() == object::kind::real;
+      }
+      return ret;
+    }
+  );
+
+  measure
+  (
+    "mapv inc",
+    [&]
+    { return mapv(detail::function{ &inc }, reals).expect<detail::vector>().size(); }
+  );
+
+  measure
+  (
+    "reduce +",
+    [&]
+    { return reduce(detail::function{ &_gen_plus_ }, object{ 0.0 }, reals); }
+  );
+
+  measure
+  (
+    "reduce + over range",
+    []
+    {
+      return reduce
+      (detail::function{ &_gen_plus_ }, object{ 0 }, range(object{ 0 }, object{ count }));
+    }
+  );
+}
@@ -0,0 +1,112 @@
+/* Compares the prelude's generators against the mt19937 which rand used to
+ * use. Build from the repo root with:
+ *
+ *   c++ -O2 -std=c++17 -pthread -I backend/neo-c++/include -I lib/immer \
+ *     -o random backend/neo-c++/benchmark/random.cpp
+ */
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <prelude.hpp>
+
+namespace
+{
+  using jank::detail::real;
+
+  size_t constexpr count{ 1 << 24 };
+
+  template <typename F>
+  void measure(char const * const name, F const &f)
+  {
+    auto const start(std::chrono::steady_clock::now());
+    auto const sum(f());
+    auto const end(std::chrono::steady_clock::now());
+    auto const ns(std::chrono::duration<double, std::nano>(end - start).count());
+
+    /* The sum keeps the work from being optimized out. */
+    std::cout << name << ": " << (ns / count) << " ns/number"
+              << " (sum " << sum << ")" << std::endl;
+  }
+
+  /* Each generator fills the same small buffer, reused, so this measures
+   * generation rather than memory bandwidth. Only one number from each fill
+   * is summed, so that adding them up doesn't become the bottleneck. */
+  template <typename F>
+  real fill_all(F const &fill)
+  {
+    std::vector<real> reals(4096);
+    real sum{};
+    for(size_t i{}; i < count; i += reals.size())
+    {
+      fill(reals.data(), reals.size());
+      sum += reals[i % reals.size()];
+    }
+    return sum;
+  }
+}
+
+int main()
+{
+  measure
+  (
+    "mt19937",
+    []
+    {
+      std::mt19937 generator{ std::mt19937::default_seed };
+      std::uniform_real_distribution<real> distribution(0.0, 1.0);
+      return fill_all
+      (
+        [&](real * const out, size_t const n)
+        {
+          for(size_t i{}; i < n; ++i)
+          { out[i] = distribution(generator); }
+        }
+      );
+    }
+  );
+
+  measure
+  (
+    "xoshiro256",
+    []
+    {
+      auto &generator(jank::detail::thread_generator());
+      return fill_all
+      (
+        [&](real * const out, size_t const n)
+        {
+          for(size_t i{}; i < n; ++i)
+          { out[i] = generator.next_real(); }
+        }
+      );
+    }
+  );
+
+  measure
+  (
+    "bulk_generator",
+    []
+    {
+      jank::detail::bulk_generator generator{ jank::detail::thread_generator() };
+      return fill_all
+      (
+        [&](real * const out, size_t const n)
+        { generator.fill(out, n); }
+      );
+    }
+  );
+
+  measure
+  (
+    "rand",
+    []
+    {
+      real sum{};
+      for(size_t i{}; i < count; ++i)
+      { sum += *jank::rand().get<real>(); }
+      return sum;
+    }
+  );
+}
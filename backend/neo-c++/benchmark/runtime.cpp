@@ -0,0 +1,178 @@
+/* The runtime's benchmark suite: making and copying objects, calling
+ * functions, arithmetic, collection updates and lookups, seq fns, and
+ * hashing, including collections used as keys. bin/benchmark builds and runs it, along with the jank benchmarks,
+ * but it can also be built from the repo root with:
+ *
+ *   c++ -O2 -std=c++17 -pthread -I backend/neo-c++/include -I lib/immer \
+ *     -o runtime backend/neo-c++/benchmark/runtime.cpp
+ *
+ * Results are JSON lines on stdout; see harness.hpp.
+ */
+#include <prelude.hpp>
+
+#include "harness.hpp"
+
+int main()
+{
+  using namespace jank;
+
+  benchmark::runner r{ "runtime" };
+
+  detail::integer constexpr size{ 1000 };
+  object const integers
+  {
+    []
+    {
+      detail::vector_transient ret;
+      for(detail::integer i{}; i < size; ++i)
+      { ret.push_back(object{ i }); }
+      return ret.persistent();
+    }()
+  };
+  object const reals
+  {
+    []
+    {
+      detail::vector_transient ret;
+      for(detail::integer i{}; i < size; ++i)
+      { ret.push_back(object{ static_cast<detail::real>(i) }); }
+      return ret.persistent();
+    }()
+  };
+  object const integer_set
+  {
+    []
+    {
+      detail::set_transient ret;
+      for(detail::integer i{}; i < size; ++i)
+      { ret.insert(object{ i }); }
+      return ret.persistent();
+    }()
+  };
+  object const integer_map
+  {
+    []
+    {
+      detail::map_transient ret;
+      for(detail::integer i{}; i < size; ++i)
+      { ret.set(object{ i }, object{ i }); }
+      return ret.persistent();
+    }()
+  };
+
+  /* Like the vec3s of ray.jank. */
+  object const r_key{ "r" }, g_key{ "g" }, b_key{ "b" };
+  object const vec3
+  {
+    JANK_MAP
+    (
+      JANK_MAP_ENTRY(r_key, object{ 0.1 }),
+      JANK_MAP_ENTRY(g_key, object{ 0.2 }),
+      JANK_MAP_ENTRY(b_key, object{ 0.3 })
+    )
+  };
+  static detail::shape const vec3_shape{ r_key, g_key, b_key };
+  object const vec3_record{ JANK_RECORD(vec3_shape, object{ 0.1 }, object{ 0.2 }, object{ 0.3 }) };
+
+  /* Keys which are themselves collections: vectors of small vectors, like
+   * grid coordinates paired with their neighbors. */
+  auto const nested_key
+  (
+    [](detail::integer const i)
+    {
+      detail::vector_transient ret;
+      for(detail::integer j{}; j < 16; ++j)
+      { ret.push_back(JANK_VECTOR(object{ i }, object{ j })); }
+      return object{ ret.persistent() };
+    }
+  );
+  detail::integer constexpr nested_size{ 100 };
+  std::vector<object> nested_keys;
+  for(detail::integer i{}; i < nested_size; ++i)
+  { nested_keys.push_back(nested_key(i)); }
+  object const nested_map
+  {
+    [&]
+    {
+      detail::map_transient ret;
+      for(detail::integer i{}; i < nested_size; ++i)
+      { ret.set(nested_keys[i], object{ i }); }
+      return ret.persistent();
+    }()
+  };
+  object const nested_set
+  {
+    [&]
+    {
+      detail::set_transient ret;
+      for(auto const &key : nested_keys)
+      { ret.insert(key); }
+      return ret.persistent();
+    }()
+  };
+  object const nested_lookup{ nested_keys[nested_size / 2] };
+
+  object const plus{ detail::function{ &_gen_plus_ } };
+  object const increment{ detail::function{ &inc } };
+  object const offset{ 10 };
+  object const add_offset
+  {
+    detail::function
+    {
+      [offset](object const &o)
+      { return _gen_plus_(o, offset); }
+    }
+  };
+
+  object one{ 1 }, two{ 2 };
+  object half{ 0.5 }, quarter{ 0.25 };
+  object index{ 500 };
+  object const range_end{ size };
+
+  r.run("make integer", [&]{ return object{ *index.get<detail::integer>() }; });
+  r.run("make real", [&]{ return object{ *half.get<detail::real>() }; });
+  r.run("make string", []{ return object{ "meow" }; });
+  r.run("make vector", [&]{ return JANK_VECTOR(one, two, one); });
+  r.run("make map", [&]{ return JANK_MAP(JANK_MAP_ENTRY(one, two), JANK_MAP_ENTRY(two, one)); });
+  r.run("copy integer", [&]{ return object{ one }; });
+  r.run("copy vector", [&]{ return object{ integers }; });
+
+  r.run("invoke fn pointer", [&]{ return detail::invoke(&_gen_plus_, one, two); });
+  r.run("invoke function", [&]{ return detail::invoke(&plus, one, two); });
+  r.run("invoke closure", [&]{ return detail::invoke(&add_offset, one); });
+
+  r.run("_gen_plus_ integer", [&]{ return _gen_plus_(one, two); });
+  r.run("_gen_plus_ real", [&]{ return _gen_plus_(half, quarter); });
+  r.run("_gen_plus_ mixed", [&]{ return _gen_plus_(one, half); });
+
+  r.run("get vector", [&]{ return get(integers, index); });
+  r.run("get map", [&]{ return get(integer_map, index); });
+  r.run("get string key", [&]{ return get(vec3, g_key); });
+  r.run("get record", [&]{ return get(vec3_record, g_key); });
+  /* As generated code does, for gets with a constant key. */
+  detail::get_cache map_cache{ g_key }, record_cache{ g_key };
+  r.run("get string key cached", [&]{ return object{ detail::get_ref(vec3, map_cache) }; });
+  r.run("get record cached", [&]{ return object{ detail::get_ref(vec3_record, record_cache) }; });
+  r.run("assoc vector", [&]{ return assoc(integers, index, two); });
+  r.run("assoc map", [&]{ return assoc(integer_map, index, two); });
+  r.run("assoc record", [&]{ return assoc(vec3_record, g_key, half); });
+  r.run("conj vector", [&]{ return conj(integers, two); });
+
+  r.run("mapv inc 1000", [&]{ return mapv(increment, integers); });
+  r.run("mapv closure 1000", [&]{ return mapv(add_offset, integers); });
+  r.run("reduce + 1000", [&]{ return reduce(plus, object{ 0.0 }, reals); });
+  r.run("reduce + range 1000", [&]{ return reduce(plus, object{ 0 }, range(object{ 0 }, range_end)); });
+
+  r.run("hash vector 1000", [&]{ return std::hash<object>{}(integers); });
+  r.run("hash set 1000", [&]{ return std::hash<object>{}(integer_set); });
+  r.run("hash map 1000", [&]{ return std::hash<object>{}(integer_map); });
+  r.run("hash record", [&]{ return std::hash<object>{}(vec3_record); });
+  r.run("hash function", [&]{ return std::hash<object>{}(add_offset); });
+
+  /* The same key each time, as when a value is looked up again and again,
+   * and a new, equal key each time, which has to be hashed at least once. */
+  r.run("get nested vector key", [&]{ return get(nested_map, nested_lookup); });
+  r.run("get new nested vector key", [&]{ return get(nested_map, nested_key(nested_size / 2)); });
+  r.run("assoc nested vector key", [&]{ return assoc(nested_map, nested_lookup, one); });
+  r.run("conj set nested vector", [&]{ return conj(nested_set, nested_lookup); });
+}
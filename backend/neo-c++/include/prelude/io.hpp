@@ -1,10 +1,20 @@
 #pragma once
 
+#include <prelude/library.hpp>
 #include <prelude/object.hpp>
 
 namespace jank
 {
-  inline object print(object const &o)
+  object print(object const &o);
+  object println(object const &o);
+  object flush();
+  object read_gen_minus_line();
+}
+
+#ifdef JANK_PRELUDE_DEFINITIONS
+namespace jank
+{
+  JANK_PRELUDE_FN object print(object const &o)
   {
     o.visit
     (
@@ -14,23 +24,24 @@ namespace jank
     return JANK_NIL;
   }
 
-  inline object println(object const &o)
+  JANK_PRELUDE_FN object println(object const &o)
   {
     print(o);
     std::cout << "\n";
     return JANK_NIL;
   }
 
-  inline object flush()
+  JANK_PRELUDE_FN object flush()
   {
     std::cout << std::flush;
     return JANK_NIL;
   }
 
-  inline object read_gen_minus_line()
+  JANK_PRELUDE_FN object read_gen_minus_line()
   {
     detail::string input;
     std::getline(std::cin, input);
     return object{ std::move(input) };
   }
 }
+#endif
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <mutex>
+
+#include <prelude/object.hpp>
+#include <prelude/util.hpp>
+
+namespace jank::detail
+{
+  /* Each element is pushed into the step, in order, until it returns false. */
+  using lazy_step = function_ref<bool (object const&)>;
+
+  /* Pushes each element of a seqable object into the step. Returns false if
+   * the object isn't seqable. */
+  bool each(object const &seq, lazy_step const &step);
+
+  /* Nodes don't hold any elements; they push them through to the next node's
+   * step as they're made. So a whole chain, like a range being mapped and then
+   * reduced, runs as one loop without any intermediate collections. */
+  struct lazy_node
+  {
+    virtual ~lazy_node() = default;
+
+    virtual void each(lazy_step const &step) const = 0;
+
+    vector const& realized() const
+    {
+      std::call_once
+      (
+        realized_flag,
+        [&]
+        {
+          vector_transient ret;
+          each
+          (
+            [&](object const &o)
+            {
+              ret.push_back(o);
+              return true;
+            }
+          );
+          realized_data = ret.persistent();
+        }
+      );
+      return realized_data;
+    }
+
+    mutable std::once_flag realized_flag;
+    mutable vector realized_data;
+  };
+
+  struct range_node : lazy_node
+  {
+    range_node(integer const start, integer const end)
+      : start{ start }, end{ end }
+    { }
+
+    void each(lazy_step const &step) const override
+    {
+      for(auto i(start); i < end; ++i)
+      {
+        if(!step(object{ i }))
+        { return; }
+      }
+    }
+
+    integer start{}, end{};
+  };
+
+  struct map_node : lazy_node
+  {
+    map_node(function const &f, object const &source)
+      : f{ f }, source{ source }
+    { }
+
+    void each(lazy_step const &step) const override
+    {
+      detail::each
+      (
+        source,
+        [&](object const &o)
+        { return step(f(o)); }
+      );
+    }
+
+    function f;
+    object source;
+  };
+
+  struct filter_node : lazy_node
+  {
+    filter_node(function const &pred, object const &source)
+      : pred{ pred }, source{ source }
+    { }
+
+    void each(lazy_step const &step) const override
+    {
+      detail::each
+      (
+        source,
+        [&](object const &o)
+        {
+          if(truthy(pred(o)))
+          { return step(o); }
+          return true;
+        }
+      );
+    }
+
+    function pred;
+    object source;
+  };
+
+  inline bool each(object const &seq, lazy_step const &step)
+  {
+    switch(seq.get_kind())
+    {
+      case object::kind::lazy_seq:
+        seq.expect<lazy_seq>().node->each(step);
+        return true;
+      case object::kind::vector:
+        for(auto const &e : seq.expect<vector>())
+        {
+          if(!step(e))
+          { break; }
+        }
+        return true;
+      case object::kind::set:
+        for(auto const &e : seq.expect<set>())
+        {
+          if(!step(e))
+          { break; }
+        }
+        return true;
+      case object::kind::map:
+        for(auto const &p : seq.expect<map>())
+        {
+          if(!step(object{ vector{ p.first, p.second } }))
+          { break; }
+        }
+        return true;
+      case object::kind::record:
+      {
+        auto const &data(seq.expect<record>());
+        for(size_t i{}; i < data.fields.size(); ++i)
+        {
+          if(!step(object{ vector{ data.record_shape->keys[i], data.fields[i] } }))
+          { break; }
+        }
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  template <typename Node, typename... Args>
+  object make_lazy_seq(Args &&... args)
+  { return object{ lazy_seq{ std::make_shared<Node const>(std::forward<Args>(args)...) } }; }
+
+  inline vector const& realize(lazy_seq const &s)
+  { return s.node->realized(); }
+
+  inline bool operator==(lazy_seq const &l, lazy_seq const &r)
+  { return l.node == r.node || realize(l) == realize(r); }
+  inline bool operator!=(lazy_seq const &l, lazy_seq const &r)
+  { return !(l == r); }
+  inline bool operator==(lazy_seq const &l, vector const &r)
+  { return realize(l) == r; }
+  inline bool operator!=(lazy_seq const &l, vector const &r)
+  { return !(l == r); }
+  inline bool operator==(vector const &l, lazy_seq const &r)
+  { return r == l; }
+  inline bool operator!=(vector const &l, lazy_seq const &r)
+  { return !(r == l); }
+}
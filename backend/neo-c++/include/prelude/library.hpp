@@ -0,0 +1,19 @@
+#pragma once
+
+/* The prelude is header only, unless JANK_PRELUDE_LIBRARY is set. Then the
+ * fns within JANK_PRELUDE_DEFINITIONS sections, which are too big or too cold
+ * to be worth inlining, are compiled just once, into a static library, by
+ * src/prelude.cpp, and everything else only sees their declarations. Hot fns,
+ * like arithmetic and get, and templates stay in the headers either way.
+ *
+ * The library has to be built with the same flags as what links to it, since
+ * those change the memory policy, and so the types, of the runtime. */
+#ifdef JANK_PRELUDE_LIBRARY
+#define JANK_PRELUDE_FN
+#else
+#define JANK_PRELUDE_FN inline
+#endif
+
+#if !defined(JANK_PRELUDE_LIBRARY) || defined(JANK_PRELUDE_IMPLEMENTATION)
+#define JANK_PRELUDE_DEFINITIONS
+#endif
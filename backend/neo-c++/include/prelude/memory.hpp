@@ -0,0 +1,330 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <utility>
+
+#include <immer/memory_policy.hpp>
+#include <immer/heap/cpp_heap.hpp>
+#include <immer/heap/free_list_heap.hpp>
+#include <immer/heap/heap_policy.hpp>
+
+/* Everything the runtime allocates goes through runtime_heap: the nodes of
+ * collections, by way of the memory policy, and the cells of objects. These
+ * compile flags change what it does:
+ *
+ *   JANK_POOL_HEAP         Allocate from thread-local pools, rather than
+ *                          with operator new.
+ *   JANK_GC                Allocate from the Boehm collector, rather than
+ *                          counting references. Link with -lgc -lgccpp, so
+ *                          that the C++ heap is scanned for roots as well.
+ *   JANK_SINGLE_THREADED   Count references without atomic instructions, and
+ *                          run parallel work on the calling thread. bin/jank
+ *                          sets this for programs which never use threads.
+ *   JANK_ALLOCATION_STATS  Count allocations, and report them on exit. */
+#if defined(JANK_GC) && defined(JANK_POOL_HEAP)
+#error "JANK_GC and JANK_POOL_HEAP can't be used together"
+#endif
+
+#ifdef JANK_SINGLE_THREADED
+#include <immer/heap/unsafe_free_list_heap.hpp>
+#include <immer/lock/no_lock_policy.hpp>
+#include <immer/refcount/unsafe_refcount_policy.hpp>
+#endif
+
+#ifdef JANK_GC
+#ifndef GC_THREADS
+#define GC_THREADS
+#endif
+#include <gc/gc.h>
+#include <immer/heap/gc_heap.hpp>
+#include <immer/refcount/no_refcount_policy.hpp>
+#include <immer/transience/gc_transience_policy.hpp>
+#endif
+
+namespace jank::detail
+{
+  /* Under the collector, nothing is counted or freed; it's all just dropped. */
+#ifdef JANK_GC
+  bool constexpr garbage_collected{ true };
+#else
+  bool constexpr garbage_collected{ false };
+#endif
+
+#ifdef JANK_SINGLE_THREADED
+  bool constexpr single_threaded{ true };
+#else
+  bool constexpr single_threaded{ false };
+#endif
+
+  /* The count of a shared cell or closure. With only the one thread, the
+   * relaxed load and store compile to a plain increment or decrement, with
+   * no lock prefix or fences. */
+  class reference_count
+  {
+    public:
+      void increment()
+      {
+        if constexpr(single_threaded)
+        { count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        else
+        { count.fetch_add(1, std::memory_order_relaxed); }
+      }
+
+      /* Whether that was the last reference. */
+      bool decrement()
+      {
+        if constexpr(single_threaded)
+        {
+          auto const remaining(count.load(std::memory_order_relaxed) - 1);
+          count.store(remaining, std::memory_order_relaxed);
+          return remaining == 0;
+        }
+        else
+        { return count.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+      }
+
+      bool unique() const
+      {
+        auto constexpr order
+        (single_threaded ? std::memory_order_relaxed : std::memory_order_acquire);
+        return count.load(order) == 1;
+      }
+
+    private:
+      std::atomic<size_t> count{ 1 };
+  };
+
+  /* Relaxed atomics are enough, since they're only read once the program is
+   * done. */
+  struct allocation_stats
+  {
+    static allocation_stats& instance()
+    {
+      static allocation_stats stats;
+      return stats;
+    }
+
+    void report(std::ostream &os) const
+    {
+      os << "allocations: " << allocations.load()
+         << " (" << allocated_bytes.load() << " bytes)\n"
+         << "deallocations: " << deallocations.load()
+         << " (" << deallocated_bytes.load() << " bytes)\n"
+         << "pool blocks: " << pool_blocks.load() << "\n";
+#ifdef JANK_GC
+      os << "collections: " << GC_get_gc_no() << "\n"
+         << "collected heap: " << GC_get_heap_size() << " bytes\n";
+#endif
+      os << std::flush;
+    }
+
+    std::atomic<size_t> allocations{};
+    std::atomic<size_t> allocated_bytes{};
+    std::atomic<size_t> deallocations{};
+    std::atomic<size_t> deallocated_bytes{};
+    std::atomic<size_t> pool_blocks{};
+  };
+
+  /* Pools for each size class, in multiples of 16 bytes, up to max_size.
+   * That covers cells and the nodes of collections with a branching factor
+   * of 32. Each thread has its own free lists, so there's no locking; memory
+   * freed on another thread just joins that thread's lists. Free lists are
+   * refilled by bumping through blocks, which are kept for the life of the
+   * program. Anything bigger goes straight to malloc. */
+  class pool_heap
+  {
+    public:
+      static size_t constexpr granularity{ 16 };
+      static size_t constexpr max_size{ 1024 };
+      static size_t constexpr block_size{ 64 * 1024 };
+
+      template <typename... Tags>
+      static void* allocate(size_t const size, Tags...)
+      {
+        if(size > max_size)
+        { return checked(std::malloc(size)); }
+
+        auto &pools(thread_pools());
+        auto &free_list(pools.free_lists[size_class(size)]);
+        if(free_list)
+        { return std::exchange(free_list, free_list->next); }
+
+        auto const rounded(size_class(size) * granularity);
+        if(static_cast<size_t>(pools.end - pools.next) < rounded)
+        {
+          /* What's left of the old block is less than max_size, so it's
+           * dropped, rather than sorted into the free lists. */
+          auto * const block(new_block());
+          pools.next = block + granularity;
+          pools.end = block + block_size;
+        }
+        return std::exchange(pools.next, pools.next + rounded);
+      }
+
+      template <typename... Tags>
+      static void deallocate(size_t const size, void * const data, Tags...)
+      {
+        if(size > max_size)
+        {
+          std::free(data);
+          return;
+        }
+
+        auto &free_list(thread_pools().free_lists[size_class(size)]);
+        free_list = new (data) free_node{ free_list };
+      }
+
+    private:
+      struct free_node
+      { free_node *next{}; };
+      struct pools
+      {
+        free_node *free_lists[max_size / granularity + 1]{};
+        char *next{};
+        char *end{};
+      };
+
+      /* Zero sized allocations still need their own address. */
+      static size_t size_class(size_t const size)
+      { return (std::max<size_t>(size, 1) + granularity - 1) / granularity; }
+
+      static pools& thread_pools()
+      {
+        thread_local pools ret;
+        return ret;
+      }
+
+      static void* checked(void * const p)
+      {
+        if(!p)
+        { throw std::bad_alloc{}; }
+        return p;
+      }
+
+      /* Each block starts with a link to the one before it, so they're all
+       * still reachable, for leak checkers, from the most recent one. */
+      static char* new_block()
+      {
+        static std::atomic<void*> last_block{};
+        auto * const block(static_cast<char*>(checked(std::malloc(block_size))));
+        auto *previous(last_block.load(std::memory_order_relaxed));
+        do
+        { *reinterpret_cast<void**>(block) = previous; }
+        while(!last_block.compare_exchange_weak(previous, block, std::memory_order_relaxed));
+
+#ifdef JANK_ALLOCATION_STATS
+        allocation_stats::instance().pool_blocks.fetch_add(1, std::memory_order_relaxed);
+#endif
+        return block;
+      }
+  };
+
+  struct runtime_heap
+  {
+#if defined(JANK_POOL_HEAP)
+    using base = pool_heap;
+#elif defined(JANK_GC)
+    using base = immer::gc_heap;
+#else
+    using base = immer::cpp_heap;
+#endif
+
+    template <typename... Tags>
+    static void* allocate(size_t const size, Tags... tags)
+    {
+#ifdef JANK_ALLOCATION_STATS
+      auto &stats(allocation_stats::instance());
+      stats.allocations.fetch_add(1, std::memory_order_relaxed);
+      stats.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+#endif
+      return base::allocate(size, tags...);
+    }
+
+    template <typename... Tags>
+    static void deallocate(size_t const size, void * const data, Tags... tags)
+    {
+#ifdef JANK_ALLOCATION_STATS
+      auto &stats(allocation_stats::instance());
+      stats.deallocations.fetch_add(1, std::memory_order_relaxed);
+      stats.deallocated_bytes.fetch_add(size, std::memory_order_relaxed);
+#endif
+      base::deallocate(size, data, tags...);
+    }
+  };
+
+  /* The pools and the collector already recycle nodes, so immer's own free
+   * lists are only kept in front of operator new. */
+#if defined(JANK_POOL_HEAP) || defined(JANK_GC)
+  using heap_policy = immer::heap_policy<runtime_heap>;
+#elif defined(JANK_SINGLE_THREADED)
+  using heap_policy = immer::unsafe_free_list_heap_policy<runtime_heap>;
+#else
+  using heap_policy = immer::free_list_heap_policy<runtime_heap>;
+#endif
+
+#if defined(JANK_GC)
+  using refcount_policy = immer::no_refcount_policy;
+#elif defined(JANK_SINGLE_THREADED)
+  using refcount_policy = immer::unsafe_refcount_policy;
+#else
+  using refcount_policy = immer::default_refcount_policy;
+#endif
+
+#ifdef JANK_SINGLE_THREADED
+  using lock_policy = immer::no_lock_policy;
+#else
+  using lock_policy = immer::default_lock_policy;
+#endif
+
+#ifdef JANK_GC
+  using memory_policy = immer::memory_policy
+  <heap_policy, refcount_policy, lock_policy, immer::gc_transience_policy, false>;
+#else
+  using memory_policy = immer::memory_policy<heap_policy, refcount_policy, lock_policy>;
+#endif
+
+  /* Under the collector, a T which owns memory outside of it, like a
+   * string, needs finalizing, so that its destructor runs once it's been
+   * collected. Finalizers aren't free, so everything else is left as is. */
+  template <typename T, bool Finalize = false, typename... Args>
+  T* heap_new(Args &&... args)
+  {
+    auto * const memory(runtime_heap::allocate(sizeof(T)));
+    T *ret{};
+    try
+    { ret = new (memory) T(std::forward<Args>(args)...); }
+    catch(...)
+    {
+      runtime_heap::deallocate(sizeof(T), memory);
+      throw;
+    }
+
+#ifdef JANK_GC
+    if constexpr(Finalize)
+    {
+      GC_register_finalizer_no_order
+      (
+        memory,
+        [](void * const t, void*)
+        { static_cast<T*>(t)->~T(); },
+        nullptr,
+        nullptr,
+        nullptr
+      );
+    }
+#endif
+    return ret;
+  }
+
+  template <typename T>
+  void heap_delete(T const * const t)
+  {
+    t->~T();
+    runtime_heap::deallocate(sizeof(T), const_cast<T*>(t));
+  }
+}
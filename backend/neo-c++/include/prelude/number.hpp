@@ -1,17 +1,47 @@
 #pragma once
 
 #include <cmath>
-#include <random>
+#include <vector>
 
 #include <prelude/object.hpp>
+#include <prelude/random.hpp>
 
 namespace jank
 {
   inline object rand()
+  { return object{ detail::thread_generator().next_real() }; }
+
+  /* rand-int */
+  inline object rand_gen_minus_int(object const &n)
+  {
+    auto const * const bound(n.get<detail::integer>());
+    if(!bound || *bound <= 0)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "rand-int bound must be a positive integer" << std::endl;
+      return JANK_NIL;
+    }
+    return object{ detail::thread_generator().next_integer(*bound) };
+  }
+
+  /* rand-reals: a vector of n reals, generated in bulk. */
+  inline object rand_gen_minus_reals(object const &n)
   {
-    static std::uniform_real_distribution<detail::real> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    auto const * const count(n.get<detail::integer>());
+    if(!count || *count < 0)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "rand-reals count must be a non-negative integer" << std::endl;
+      return JANK_NIL;
+    }
+
+    std::vector<detail::real> reals(*count);
+    detail::fill_reals(reals.data(), reals.size());
+
+    detail::vector_transient ret;
+    for(auto const r : reals)
+    { ret.push_back(object{ r }); }
+    return object{ ret.persistent() };
   }
 
   /* + */
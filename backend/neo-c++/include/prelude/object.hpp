@@ -1,9 +1,18 @@
 #pragma once
 
 #include <experimental/iterator>
+#include <atomic>
+#include <cstdint>
 #include <type_traits>
-#include <any>
-#include <functional>
+#include <utility>
+#include <memory>
+#include <array>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <tuple>
+#include <initializer_list>
 
 #include <immer/vector.hpp>
 #include <immer/vector_transient.hpp>
@@ -11,7 +20,10 @@
 #include <immer/map_transient.hpp>
 #include <immer/set.hpp>
 #include <immer/set_transient.hpp>
-#include <immer/box.hpp>
+#include <immer/array.hpp>
+
+#include <prelude/memory.hpp>
+#include <prelude/library.hpp>
 
 namespace jank
 { class object; }
@@ -23,33 +35,322 @@ namespace jank::detail
   using boolean = bool;
   using string = std::string;
 
+  struct function;
+
+  /* Collections allocate through the runtime's memory policy. */
+  template <typename T>
+  using persistent_vector = immer::vector<T, memory_policy>;
+  template <typename T>
+  using persistent_set = immer::set<T, std::hash<T>, std::equal_to<T>, memory_policy>;
+  template <typename K, typename V>
+  using persistent_map = immer::map<K, V, std::hash<K>, std::equal_to<K>, memory_policy>;
+  template <typename T>
+  using persistent_array = immer::array<T, memory_policy>;
+
+  template <size_t N, typename... Args>
+  struct build_arity : build_arity<N - 1, Args..., object>
+  { };
+  template <typename... Args>
+  struct build_arity<0, Args...>
+  {
+    using type = object (Args const&...);
+    using entry_type = object (*)(function const&, Args const&...);
+  };
+
+  template <size_t>
+  using object_for = object;
+
+  template <typename F>
+  struct callable_arity
+  { static size_t constexpr value{ callable_arity<decltype(&F::operator())>::value }; };
+  template <typename R, typename C, typename... Args>
+  struct callable_arity<R (C::*)(Args...) const>
+  { static size_t constexpr value{ sizeof...(Args) }; };
+  template <typename R, typename C, typename... Args>
+  struct callable_arity<R (C::*)(Args...)>
+  { static size_t constexpr value{ sizeof...(Args) }; };
+  template <typename R, typename... Args>
+  struct callable_arity<R (*)(Args...)>
+  { static size_t constexpr value{ sizeof...(Args) }; };
+  /* Closures which refer to themselves take their function first. */
+  template <typename R, typename C, typename... Args>
+  struct callable_arity<R (C::*)(function const&, Args...) const>
+  { static size_t constexpr value{ sizeof...(Args) }; };
+
+  /* What a closure captured, shared by every copy of its function. Generated
+   * closures are structs of exactly the values they capture, so making one is
+   * a single allocation and copying one is a count. */
+  struct closure_header
+  {
+    mutable reference_count references;
+    void (*destroy)(closure_header const*){};
+  };
+  template <typename Callable>
+  struct closure : closure_header
+  {
+    template <typename F>
+    explicit closure(F &&f)
+      : callable{ std::forward<F>(f) }
+    {
+      destroy = [](closure_header const * const c)
+      { heap_delete(static_cast<closure const*>(c)); };
+    }
+
+    Callable callable;
+  };
+
+  /* A function has a vtable with one entry per arity. Calling it is an index
+   * into that table and an indirect call; there's no type erasure to unwrap.
+   * Plain function pointers, including captureless lambdas, are stored inline.
+   * Closures with state are shared between copies, by reference counting. */
   struct function
   {
-    template <typename T>
-    using value_type = std::function<T>;
+    static size_t constexpr max_arity{ 10 };
 
+    using erased_entry = void (*)();
+    struct vtable
+    { std::array<erased_entry, max_arity + 1> entries{}; };
+
+    function() = default;
     template <typename R, typename... Args>
-    function(R (* const f)(Args...)) : function(value_type<R (Args...)>{ f })
-    { }
-    template <typename R, typename... Args>
-    function(value_type<R (Args...)> &&f) : value{ std::move(f) }
+    function(R (* const f)(Args...))
+      : table{ pointer_table<R (*)(Args...)>() }
+      , target{ reinterpret_cast<erased_entry>(f) }
     { }
-    template <typename R, typename... Args>
-    function(value_type<R (Args...)> const &f) : value{ f }
+    template
+    <
+      typename F,
+      std::enable_if_t
+      <
+        std::is_class_v<std::decay_t<F>> && !std::is_same_v<std::decay_t<F>, function>,
+        bool
+      > = true
+    >
+    function(F &&f)
+    {
+      using callable = std::decay_t<F>;
+      size_t constexpr arity{ callable_arity<callable>::value };
+      using pointer = std::add_pointer_t<typename build_arity<arity>::type>;
+
+      if constexpr(std::is_convertible_v<callable, pointer>)
+      {
+        table = pointer_table<pointer>();
+        target = reinterpret_cast<erased_entry>(static_cast<pointer>(f));
+      }
+      else
+      {
+        table = closure_table<callable, arity>();
+        context = heap_new<closure<callable>>(std::forward<F>(f));
+      }
+    }
+    function(function const &f)
+      : table{ f.table }, target{ f.target }, context{ f.context }
+    { retain(); }
+    function(function &&f) noexcept
+      : table{ f.table }, target{ f.target }, context{ std::exchange(f.context, nullptr) }
     { }
+    ~function()
+    { release(); }
+
+    function& operator=(function f) noexcept
+    {
+      std::swap(table, f.table);
+      std::swap(target, f.target);
+      std::swap(context, f.context);
+      return *this;
+    }
+
+    bool supports(size_t const arity) const
+    { return table && arity <= max_arity && table->entries[arity]; }
+
+    template <typename... Args>
+    object operator()(Args const &... args) const;
+
+    vtable const *table{};
+    erased_entry target{};
+    closure_header const *context{};
+
+    private:
+      /* Under the collector, closures are only ever dropped. */
+      void retain() const
+      {
+        if(!garbage_collected && context)
+        { context->references.increment(); }
+      }
+      void release() const
+      {
+        if(!garbage_collected
+           && context
+           && context->references.decrement())
+        { context->destroy(context); }
+      }
+
+      template <typename Pointer, typename... Args>
+      static object call_pointer(function const &f, Args const &... args);
+      template <typename Callable, typename... Args>
+      static object call_closure(function const &f, Args const &... args);
+
+      template <typename Pointer, size_t... Is>
+      static vtable const* pointer_table(std::index_sequence<Is...>)
+      {
+        static vtable const table
+        {
+          [&]
+          {
+            vtable ret;
+            ret.entries[sizeof...(Is)] = reinterpret_cast<erased_entry>
+            (&call_pointer<Pointer, object_for<Is>...>);
+            return ret;
+          }()
+        };
+        return &table;
+      }
+      template <typename Pointer>
+      static vtable const* pointer_table()
+      {
+        return pointer_table<Pointer>
+        (std::make_index_sequence<callable_arity<Pointer>::value>{});
+      }
+
+      template <typename Callable, size_t... Is>
+      static vtable const* closure_table(std::index_sequence<Is...>)
+      {
+        static vtable const table
+        {
+          [&]
+          {
+            vtable ret;
+            ret.entries[sizeof...(Is)] = reinterpret_cast<erased_entry>
+            (&call_closure<Callable, object_for<Is>...>);
+            return ret;
+          }()
+        };
+        return &table;
+      }
+      template <typename Callable, size_t Arity>
+      static vtable const* closure_table()
+      {
+        static_assert(Arity <= max_arity, "too many function parameters");
+        return closure_table<Callable>(std::make_index_sequence<Arity>{});
+      }
+  };
+  /* Fns are equal only to themselves, and their copies. Copies share their
+   * target, or their closure. */
+  inline bool operator==(function const &l, function const &r)
+  { return l.table == r.table && l.target == r.target && l.context == r.context; }
+  inline bool operator!=(function const &l, function const &r)
+  { return !(l == r); }
+  inline bool operator<(function const &, function const &)
+  { return true; }
 
+  /* Keywords are interned, so there's only ever one instance of each. Equality
+   * is a pointer comparison and the hash is computed once, when interning. */
+  struct keyword
+  {
+    struct data
+    {
+      std::string ns;
+      std::string name;
+      size_t hash{};
+    };
+
+    data const *interned{};
+  };
+  inline bool operator==(keyword const &l, keyword const &r)
+  { return l.interned == r.interned; }
+  inline bool operator!=(keyword const &l, keyword const &r)
+  { return l.interned != r.interned; }
+  inline bool operator<(keyword const &l, keyword const &r)
+  {
+    return std::tie(l.interned->ns, l.interned->name)
+           < std::tie(r.interned->ns, r.interned->name);
+  }
+
+  /* Generated code interns its keywords at static init time, so lookups
+   * don't happen while running. */
+  keyword intern_keyword(std::string const &ns, std::string const &name);
+
+  /* A non-owning reference to a callable. Unlike std::function, making one
+   * never allocates, so it's cheap to pass a lambda down through layers. */
+  template <typename Signature>
+  struct function_ref;
+  template <typename R, typename... Args>
+  struct function_ref<R (Args...)>
+  {
     template <typename F>
-    F const* get() const
-    { return std::any_cast<F>(&value); }
+    function_ref(F const &f)
+      : target{ &f }
+      , call
+      {
+        [](void const * const target, Args... args) -> R
+        { return (*static_cast<F const*>(target))(args...); }
+      }
+    { }
+
+    R operator()(Args... args) const
+    { return call(target, args...); }
+
+    void const *target{};
+    R (*call)(void const*, Args...){};
+  };
 
-    std::any value;
+  /* A lazy seq is a chain of nodes, like a range being mapped and then
+   * filtered. The nodes are defined in prelude/lazy.hpp. */
+  struct lazy_node;
+  struct lazy_seq
+  {
+    std::shared_ptr<lazy_node const> node;
   };
-  inline bool operator==(function const &, function const &)
+  /* Realizes every element of the seq, once, and keeps them. */
+  persistent_vector<object> const& realize(lazy_seq const &s);
+  bool operator==(lazy_seq const &, lazy_seq const &);
+  bool operator!=(lazy_seq const &, lazy_seq const &);
+  bool operator==(lazy_seq const &, persistent_vector<object> const &);
+  bool operator!=(lazy_seq const &, persistent_vector<object> const &);
+  bool operator==(persistent_vector<object> const &, lazy_seq const &);
+  bool operator!=(persistent_vector<object> const &, lazy_seq const &);
+  inline bool operator<(lazy_seq const &, lazy_seq const &)
   { return true; }
-  inline bool operator!=(function const &, function const &)
-  { return false; }
-  inline bool operator<(function const &, function const &)
+
+  /* The keys of a record. Records come from map literals with constant keys,
+   * so every shape is known at compile time and only the values need to be
+   * stored. The key hashes are computed once, when the shape is made. */
+  struct shape
+  {
+    shape(std::initializer_list<object> const key_list);
+
+    /* Returns the index of the key's field, or size() if it's not present. */
+    size_t find(object const &key) const;
+    /* The same, for when the key's hash is already known. */
+    size_t find(object const &key, size_t const hash) const;
+    size_t size() const
+    { return keys.size(); }
+
+    std::vector<object> keys;
+    std::vector<size_t> hashes;
+    /* Unique to each shape, and never 0, so that get caches can identify a
+     * shape without holding onto it. */
+    std::uint32_t id{};
+  };
+
+  /* A map with a fixed set of keys, stored as a flat array of values. It
+   * behaves just like the equivalent map; assoc'ing a new key turns it into
+   * one. */
+  struct record
+  {
+    shape const *record_shape{};
+    persistent_array<object> fields;
+  };
+  bool operator==(record const &, record const &);
+  bool operator!=(record const &, record const &);
+  bool operator==(record const &, persistent_map<object, object> const &);
+  bool operator!=(record const &, persistent_map<object, object> const &);
+  bool operator==(persistent_map<object, object> const &, record const &);
+  bool operator!=(persistent_map<object, object> const &, record const &);
+  inline bool operator<(record const &, record const &)
   { return true; }
+  /* For when a record gains a key. */
+  persistent_map<object, object> record_to_map(record const &r);
 
   struct nil
   { };
@@ -60,6 +361,27 @@ namespace jank::detail
   inline bool operator<(nil const &, nil const &)
   { return true; }
 
+  /* Anything which doesn't fit inside an object, alongside its kind, is kept
+   * in a cell on the heap. Copies of the object share the cell. */
+  struct cell_header
+  {
+    detail::reference_count references;
+    /* The hash of the cell's value, once it's been hashed, or 0. Values never
+     * change once they're shared, so it never goes stale. A value which
+     * really does hash to 0 is just hashed every time. */
+    mutable std::atomic<size_t> hash{};
+  };
+  template <typename T>
+  struct cell : cell_header
+  {
+    template <typename... Args>
+    explicit cell(Args &&... args)
+      : data(std::forward<Args>(args)...)
+    { }
+
+    T data;
+  };
+
   /* Very much borrowed from boost. */
   template <typename T>
   size_t hash_combine(size_t const seed, T const &t)
@@ -70,12 +392,27 @@ namespace std
 {
   template <>
   struct hash<jank::object>;
+  template <>
+  struct hash<jank::detail::record>;
+  template <>
+  struct hash<jank::detail::lazy_seq>;
 
+  /* By identity, like equality, so that every copy of a fn hashes the same. */
   template <>
   struct hash<jank::detail::function>
   {
     size_t operator()(jank::detail::function const &f) const noexcept
-    { return reinterpret_cast<size_t>(&f); }
+    {
+      return jank::detail::hash_combine
+      (reinterpret_cast<size_t>(f.target), reinterpret_cast<size_t>(f.context));
+    }
+  };
+
+  template <>
+  struct hash<jank::detail::keyword>
+  {
+    size_t operator()(jank::detail::keyword const &k) const noexcept
+    { return k.interned->hash; }
   };
 
   template <>
@@ -86,9 +423,9 @@ namespace std
   };
 
   template <typename T>
-  struct hash<immer::vector<T>>
+  struct hash<jank::detail::persistent_vector<T>>
   {
-    size_t operator()(immer::vector<T> const &v) const noexcept
+    size_t operator()(jank::detail::persistent_vector<T> const &v) const noexcept
     {
       size_t seed{ v.size() };
       for(auto const &e : v)
@@ -98,9 +435,9 @@ namespace std
   };
 
   template <typename T>
-  struct hash<immer::set<T>>
+  struct hash<jank::detail::persistent_set<T>>
   {
-    size_t operator()(immer::set<T> const &s) const noexcept
+    size_t operator()(jank::detail::persistent_set<T> const &s) const noexcept
     {
       size_t seed{ s.size() };
       for(auto const &e : s)
@@ -109,17 +446,16 @@ namespace std
     }
   };
 
+  /* Entries are combined without regard to order, so that records hash the
+   * same as their equivalent maps. */
   template <typename K, typename V>
-  struct hash<immer::map<K, V>>
+  struct hash<jank::detail::persistent_map<K, V>>
   {
-    size_t operator()(immer::map<K, V> const &m) const noexcept
+    size_t operator()(jank::detail::persistent_map<K, V> const &m) const noexcept
     {
       size_t seed{ m.size() };
       for(auto const &e : m)
-      {
-        seed = jank::detail::hash_combine(seed, e.first);
-        seed = jank::detail::hash_combine(seed, e.second);
-      }
+      { seed += jank::detail::hash_combine(std::hash<K>{}(e.first), e.second); }
       return seed;
     }
   };
@@ -144,9 +480,6 @@ namespace jank
     template <typename R, typename... Args>
     struct conversion<R (*)(Args...)>
     { using type = function; };
-    template <typename R, typename... Args>
-    struct conversion<function::value_type<R (Args...)>>
-    { using type = function; };
 
     template <typename T>
     using conversion_t = typename conversion<T>::type;
@@ -155,12 +488,14 @@ namespace jank
   class object
   {
     public:
-      enum class kind
-      { nil, integer, real, boolean, string, vector, set, map, function };
+      enum class kind : uint8_t
+      { nil, integer, real, boolean, string, keyword, vector, lazy_seq, set, map, record, function };
 
-      using vector_type = immer::vector<immer::box<object>>;
-      using set_type = immer::set<immer::box<object>>;
-      using map_type = immer::map<object, object>;
+      using vector_type = detail::persistent_vector<object>;
+      using set_type = detail::persistent_set<object>;
+      using map_type = detail::persistent_map<object, object>;
+      using record_type = detail::record;
+      using lazy_seq_type = detail::lazy_seq;
       /* Used to detect if some type is an object. */
       static bool constexpr enable_if_object = true;
 
@@ -171,10 +506,12 @@ namespace jank
       template <typename T, std::enable_if_t<!std::is_same_v<std::decay_t<T>, object>, bool> = true>
       object(T &&data)
       { set(std::forward<T>(data)); }
-      object(object &&o)
-      { *this = std::move(o); }
+      object(object &&o) noexcept
+        : current_kind{ o.current_kind }, current_data{ o.current_data }
+      { o.current_kind = kind::nil; }
       object(object const &o)
-      { *this = o; }
+        : current_kind{ o.current_kind }, current_data{ o.current_data }
+      { retain(); }
 
       template <typename F>
       auto visit(F const &f) const -> decltype(f(detail::nil{}))
@@ -188,15 +525,21 @@ namespace jank
           case object::kind::boolean:
             return f(current_data.bool_data);
           case object::kind::string:
-            return f(current_data.string_data);
+            return f(cell_data<detail::string>());
+          case object::kind::keyword:
+            return f(current_data.keyword_data);
           case object::kind::vector:
-            return f(current_data.vector_data);
+            return f(cell_data<vector_type>());
+          case object::kind::lazy_seq:
+            return f(cell_data<lazy_seq_type>());
           case object::kind::set:
-            return f(current_data.set_data);
+            return f(cell_data<set_type>());
           case object::kind::map:
-            return f(current_data.map_data);
+            return f(cell_data<map_type>());
+          case object::kind::record:
+            return f(cell_data<record_type>());
           case object::kind::function:
-            return f(current_data.function_data);
+            return f(cell_data<detail::function>());
           case object::kind::nil:
           default:
             return f(current_data.nil_data);
@@ -218,35 +561,14 @@ namespace jank
         );
       }
 
-      object& operator=(object &&o)
+      object& operator=(object &&o) noexcept
       {
         if(&o == this)
         { return *this; }
 
         unset();
         current_kind = o.current_kind;
-
-        switch(o.current_kind)
-        {
-          case object::kind::string:
-            set(std::move(o.current_data.string_data));
-            break;
-          case object::kind::vector:
-            set(std::move(o.current_data.vector_data));
-            break;
-          case object::kind::set:
-            set(std::move(o.current_data.set_data));
-            break;
-          case object::kind::map:
-            set(std::move(o.current_data.map_data));
-            break;
-          case object::kind::function:
-            set(std::move(o.current_data.function_data));
-            break;
-          default:
-            *this = static_cast<object const&>(o);
-        }
-
+        current_data = o.current_data;
         o.current_kind = kind::nil;
         return *this;
       }
@@ -254,45 +576,41 @@ namespace jank
       {
         if(&o == this)
         { return *this; }
+        else if(is_celled(current_kind)
+                && current_kind == o.current_kind
+                && current_data.cell_data == o.current_data.cell_data)
+        { return *this; }
 
+        /* o may be within this, like an element of a vector, so it's retained
+         * and read before this lets go of anything. */
+        o.retain();
+        auto const new_kind(o.current_kind);
+        auto const new_data(o.current_data);
         unset();
-
-        switch(o.current_kind)
-        {
-          case object::kind::nil:
-            set(o.current_data.nil_data);
-            break;
-          case object::kind::integer:
-            set(o.current_data.int_data);
-            break;
-          case object::kind::real:
-            set(o.current_data.real_data);
-            break;
-          case object::kind::boolean:
-            set(o.current_data.bool_data);
-            break;
-          case object::kind::string:
-            set(o.current_data.string_data);
-            break;
-          case object::kind::vector:
-            set(o.current_data.vector_data);
-            break;
-          case object::kind::set:
-            set(o.current_data.set_data);
-            break;
-          case object::kind::map:
-            set(o.current_data.map_data);
-            break;
-          case object::kind::function:
-            set(o.current_data.function_data);
-            break;
-        }
-
+        current_kind = new_kind;
+        current_data = new_data;
         return *this;
       }
       template <typename T, std::enable_if_t<!std::is_same_v<std::decay_t<T>, object>, bool> = true>
       object& operator=(T &&data)
       {
+        using converted_type = detail::conversion_t<std::decay_t<T>>;
+        kind constexpr k{ type_to_kind<converted_type>() };
+
+        /* A cell of the same kind which nothing else shares can be reused.
+         * Under the collector, there's no telling whether it's shared. */
+        if constexpr(is_celled(k) && !detail::garbage_collected)
+        {
+          if(current_kind == k
+             && current_data.cell_data->references.unique())
+          {
+            static_cast<detail::cell<converted_type>*>(current_data.cell_data)->data
+              = std::forward<T>(data);
+            current_data.cell_data->hash.store(0, std::memory_order_relaxed);
+            return *this;
+          }
+        }
+
         unset();
         set(std::forward<T>(data));
         return *this;
@@ -304,16 +622,26 @@ namespace jank
       {
         if(&o == this)
         { return false; }
-        else if(current_kind == o.current_kind)
-        { return false; }
         return visit_with
         (
           [](auto const &l, auto const &r) -> bool
           {
             using L = std::decay_t<decltype(l)>;
             using R = std::decay_t<decltype(r)>;
+            /* Records are equal to their equivalent maps. */
+            auto constexpr is_associative_pair
+            (
+              (std::is_same_v<L, record_type> && std::is_same_v<R, map_type>)
+              || (std::is_same_v<L, map_type> && std::is_same_v<R, record_type>)
+            );
+            /* Likewise for lazy seqs and vectors. */
+            auto constexpr is_sequential_pair
+            (
+              (std::is_same_v<L, lazy_seq_type> && std::is_same_v<R, vector_type>)
+              || (std::is_same_v<L, vector_type> && std::is_same_v<R, lazy_seq_type>)
+            );
 
-            if constexpr(std::is_same_v<L, R>)
+            if constexpr(std::is_same_v<L, R> || is_associative_pair || is_sequential_pair)
             { return l != r; }
             else
             { return true; }
@@ -377,23 +705,18 @@ namespace jank
         { return current_data.real_data; }
         else if constexpr(k == kind::boolean)
         { return current_data.bool_data; }
-        else if constexpr(k == kind::string)
-        { return current_data.string_data; }
-        else if constexpr(k == kind::vector)
-        { return current_data.vector_data; }
-        else if constexpr(k == kind::set)
-        { return current_data.set_data; }
-        else if constexpr(k == kind::map)
-        { return current_data.map_data; }
-        else if constexpr(k == kind::function)
-        { return current_data.function_data; }
+        else if constexpr(k == kind::keyword)
+        { return current_data.keyword_data; }
         else
-        { static_assert((T*)nullptr, "invalid variant input"); }
+        { return cell_data<converted_type>(); }
       }
 
       kind get_kind() const
       { return current_kind; }
 
+      /* Strings and collections are only hashed once; see cell_header. */
+      size_t hash() const;
+
     private:
       template <typename T>
       static kind constexpr type_to_kind()
@@ -408,12 +731,18 @@ namespace jank
         { return kind::boolean; }
         else if constexpr(std::is_same_v<detail::string, T>)
         { return kind::string; }
+        else if constexpr(std::is_same_v<detail::keyword, T>)
+        { return kind::keyword; }
         else if constexpr(std::is_same_v<vector_type, T>)
         { return kind::vector; }
+        else if constexpr(std::is_same_v<lazy_seq_type, T>)
+        { return kind::lazy_seq; }
         else if constexpr(std::is_same_v<set_type, T>)
         { return kind::set; }
         else if constexpr(std::is_same_v<map_type, T>)
         { return kind::map; }
+        else if constexpr(std::is_same_v<record_type, T>)
+        { return kind::record; }
         else if constexpr(std::is_same_v<detail::function, T>)
         { return kind::function; }
         else
@@ -423,6 +752,17 @@ namespace jank
         }
       }
 
+      /* Scalars and keywords are stored inline. Everything else is in a cell. */
+      static bool constexpr is_celled(kind const k)
+      { return k == kind::string || k >= kind::vector; }
+      /* Cells which own memory outside of the collector, when there is one. */
+      static bool constexpr is_finalized(kind const k)
+      { return k == kind::string || k == kind::lazy_seq; }
+
+      template <typename T>
+      T const& cell_data() const
+      { return static_cast<detail::cell<T> const*>(current_data.cell_data)->data; }
+
       template <typename T>
       void set(T &&new_data)
       {
@@ -438,45 +778,39 @@ namespace jank
         { current_data.real_data = new_data; }
         else if constexpr(k == kind::boolean)
         { current_data.bool_data = new_data; }
-        else if constexpr(k == kind::string)
-        { new (&current_data.string_data) detail::string(std::forward<T>(new_data)); }
-        else if constexpr(k == kind::vector)
-        { new (&current_data.vector_data) vector_type(std::forward<T>(new_data)); }
-        else if constexpr(k == kind::set)
-        { new (&current_data.set_data) set_type(std::forward<T>(new_data)); }
-        else if constexpr(k == kind::map)
-        { new (&current_data.map_data) map_type(std::forward<T>(new_data)); }
-        else if constexpr(k == kind::function)
-        { new (&current_data.function_data) detail::function(std::forward<T>(new_data)); }
+        else if constexpr(k == kind::keyword)
+        { current_data.keyword_data = new_data; }
         else
-        { static_assert((T*)nullptr, "invalid variant input"); }
+        {
+          current_data.cell_data = detail::heap_new<detail::cell<converted_type>, is_finalized(k)>
+          (std::forward<T>(new_data));
+        }
 
         current_kind = k;
       }
 
+      /* Under the collector, cells are never counted or freed. */
+      void retain() const
+      {
+        if(!detail::garbage_collected && is_celled(current_kind))
+        { current_data.cell_data->references.increment(); }
+      }
+
       void unset()
       {
-        switch(current_kind)
+        if(!detail::garbage_collected
+           && is_celled(current_kind)
+           && current_data.cell_data->references.decrement())
         {
-          case kind::string:
-            using detail::string;
-            current_data.string_data.~string();
-            break;
-          case kind::vector:
-            current_data.vector_data.~vector_type();
-            break;
-          case kind::set:
-            current_data.set_data.~set_type();
-            break;
-          case kind::map:
-            current_data.map_data.~map_type();
-            break;
-          case kind::function:
-            using detail::function;
-            current_data.function_data.~function();
-            break;
-          default:
-            break;
+          visit
+          (
+            [&](auto const &data)
+            {
+              using T = std::decay_t<decltype(data)>;
+              if constexpr(is_celled(type_to_kind<T>()))
+              { detail::heap_delete(static_cast<detail::cell<T>*>(current_data.cell_data)); }
+            }
+          );
         }
         current_kind = kind::nil;
       }
@@ -485,75 +819,20 @@ namespace jank
       union data_union
       {
         data_union()
-        { }
-        ~data_union()
+          : nil_data{}
         { }
 
         detail::nil nil_data;
         detail::integer int_data;
         detail::real real_data;
         detail::boolean bool_data;
-        detail::string string_data;
-        vector_type vector_data;
-        set_type set_data;
-        map_type map_data;
-        detail::function function_data;
+        detail::keyword keyword_data;
+        detail::cell_header *cell_data;
       } current_data;
-
-      friend std::ostream& operator<<(std::ostream&, object const&);
   };
+  static_assert(sizeof(object) == 16, "objects should be a tag and one word");
 
-  inline std::ostream& operator<<(std::ostream &os, object const &o)
-  {
-    switch(o.current_kind)
-    {
-      case object::kind::nil:
-        os << "nil";
-        break;
-      case object::kind::integer:
-        os << o.current_data.int_data;
-        break;
-      case object::kind::real:
-        os << o.current_data.real_data;
-        break;
-      case object::kind::boolean:
-        os << (o.current_data.bool_data ? "true" : "false");
-        break;
-      case object::kind::string:
-        os << "\"" << o.current_data.string_data << "\"";
-        break;
-      case object::kind::vector:
-        os << "[";
-        std::copy
-        (
-          std::begin(o.current_data.vector_data),
-          std::end(o.current_data.vector_data),
-          std::experimental::make_ostream_joiner(os, " ")
-        );
-        os << "]";
-        break;
-      case object::kind::set:
-        os << "#{";
-        std::copy
-        (
-          std::begin(o.current_data.vector_data),
-          std::end(o.current_data.vector_data),
-          std::experimental::make_ostream_joiner(os, " ")
-        );
-        os << "}";
-        break;
-      case object::kind::map:
-        os << "{";
-        for(auto i(o.current_data.map_data.begin()); i != o.current_data.map_data.end(); ++i)
-        { os << i->first << " " << i->second << " "; }
-        os << "}";
-        break;
-      case object::kind::function:
-        os << "<function>";
-        break;
-    }
-    return os;
-  }
+  std::ostream& operator<<(std::ostream &os, object const &o);
 
   namespace detail
   {
@@ -572,22 +851,38 @@ namespace jank
   using JANK_BOOL = object;
   using JANK_STRING = object;
 
+  /* Literals are built through transients, so each element is added in
+   * place, rather than making a new collection per element. */
   template<typename... Ts>
   object JANK_VECTOR(Ts &&... args)
-  { return object{ detail::vector{ std::forward<Ts>(args)... } }; }
+  {
+    detail::vector_transient ret;
+    (ret.push_back(std::forward<Ts>(args)), ...);
+    return object{ ret.persistent() };
+  }
   template<typename... Ts>
   object JANK_SET(Ts &&... args)
-  { return object{ detail::set{ std::forward<Ts>(args)... } }; }
+  {
+    detail::set_transient ret;
+    (ret.insert(std::forward<Ts>(args)), ...);
+    return object{ ret.persistent() };
+  }
 
-  inline detail::map::value_type JANK_MAP_ENTRY(object const &k, object const &v)
-  { return { k, v }; }
+  inline object JANK_KEYWORD(std::string const &ns, std::string const &name)
+  { return object{ detail::intern_keyword(ns, name) }; }
+
+  template<typename... Ts>
+  object JANK_RECORD(detail::shape const &s, Ts &&... fields)
+  { return object{ detail::record{ &s, detail::persistent_array<object>{ std::forward<Ts>(fields)... } } }; }
+
+  inline detail::map::value_type JANK_MAP_ENTRY(object k, object v)
+  { return { std::move(k), std::move(v) }; }
   template<typename... Ts>
   object JANK_MAP(Ts &&... entries)
   {
-    /* TODO: Transient. */
-    detail::map ret;
-    int const dummy[sizeof...(Ts)]{ (ret = std::move(ret).insert(entries), 0)... };
-    return object{ ret };
+    detail::map_transient ret;
+    (ret.set(std::forward<Ts>(entries).first, std::forward<Ts>(entries).second), ...);
+    return object{ ret.persistent() };
   }
 
   static jank::object const JANK_NIL{ detail::nil{} };
@@ -605,37 +900,54 @@ namespace jank
 
   namespace detail
   {
-    template <size_t N, typename... Args>
-    struct build_arity
-    { using type = typename build_arity<N - 1, Args..., object>::type; };
     template <typename... Args>
-    struct build_arity<0, Args...>
-    { using type = object (Args const&...); };
+    object function::operator()(Args const &... args) const
+    {
+      static_assert(sizeof...(Args) <= max_arity, "too many function arguments");
+      using entry_type = typename build_arity<sizeof...(Args)>::entry_type;
 
-    template <typename F, typename... Args>
-    auto extract_function(F const &f)
+      if(!supports(sizeof...(Args)))
+      {
+        /* TODO: Throw error. */
+        std::cout << "invalid function arity" << std::endl;
+        return JANK_NIL;
+      }
+
+      return reinterpret_cast<entry_type>(table->entries[sizeof...(Args)])(*this, args...);
+    }
+
+    template <typename Pointer, typename... Args>
+    object function::call_pointer(function const &f, Args const &... args)
+    { return reinterpret_cast<Pointer>(f.target)(args...); }
+    template <typename Callable, typename... Args>
+    object function::call_closure(function const &f, Args const &... args)
     {
-      size_t constexpr arg_count{ sizeof...(Args) };
-      using arity = typename build_arity<arg_count>::type;
-      using function_type = detail::function::value_type<arity>;
+      auto const &callable(static_cast<closure<Callable> const*>(f.context)->callable);
+      if constexpr(std::is_invocable_v<Callable const&, function const&, Args const&...>)
+      { return callable(f, args...); }
+      else
+      { return callable(args...); }
+    }
 
+    template <typename F, typename... Args>
+    function const* extract_function(F const &f)
+    {
       auto const * const func(f->template get<detail::function>());
       if(!func)
       {
         /* TODO: Throw error. */
         std::cout << "object is not a function" << std::endl;
-        return static_cast<function_type const*>(nullptr);
+        return nullptr;
       }
 
-      auto const * const func_ptr(func->template get<function_type>());
-      if(!func_ptr)
+      if(!func->supports(sizeof...(Args)))
       {
         /* TODO: Throw error. */
         std::cout << "invalid function arity" << std::endl;
-        return static_cast<function_type const*>(nullptr);
+        return nullptr;
       }
 
-      return func_ptr;
+      return func;
     }
 
     template <typename F, typename... Args>
@@ -645,10 +957,10 @@ namespace jank
       { return f(std::forward<Args>(args)...); }
       else
       {
-        auto const * const func_ptr(extract_function<F, Args...>(f));
+        auto const * const func(extract_function<F, Args...>(f));
 
-        if(func_ptr)
-        { return (*func_ptr)(std::forward<Args>(args)...); }
+        if(func)
+        { return (*func)(args...); }
         else
         { return JANK_NIL; }
       }
@@ -658,19 +970,248 @@ namespace jank
 
 namespace std
 {
+  template <>
+  struct hash<jank::detail::record>
+  {
+    size_t operator()(jank::detail::record const &r) const noexcept
+    {
+      size_t seed{ r.fields.size() };
+      for(size_t i{}; i < r.fields.size(); ++i)
+      { seed += jank::detail::hash_combine(r.record_shape->hashes[i], r.fields[i]); }
+      return seed;
+    }
+  };
+
+  /* Lazy seqs hash the same as their equivalent vectors. */
+  template <>
+  struct hash<jank::detail::lazy_seq>
+  {
+    size_t operator()(jank::detail::lazy_seq const &s) const noexcept
+    { return std::hash<jank::object::vector_type>{}(jank::detail::realize(s)); }
+  };
+
   template <>
   struct hash<jank::object>
   {
     size_t operator()(jank::object const &o) const noexcept
-    {
-      return o.visit
-      (
-        [&](auto const &data) -> size_t
+    { return o.hash(); }
+  };
+}
+
+namespace jank
+{
+  inline size_t object::hash() const
+  {
+    return visit
+    (
+      [&](auto const &data) -> size_t
+      {
+        using T = std::decay_t<decltype(data)>;
+        /* Fns hash by identity, which is already cheap. */
+        if constexpr(is_celled(type_to_kind<T>()) && !std::is_same_v<T, detail::function>)
         {
-          using T = std::decay_t<decltype(data)>;
-          return std::hash<T>()(data);
+          auto &memo(current_data.cell_data->hash);
+          auto ret(memo.load(std::memory_order_relaxed));
+          if(ret == 0)
+          {
+            ret = std::hash<T>()(data);
+            memo.store(ret, std::memory_order_relaxed);
+          }
+          return ret;
         }
-      );
+        else
+        { return std::hash<T>()(data); }
+      }
+    );
+  }
+}
+
+namespace jank::detail
+{
+  inline size_t shape::find(object const &key) const
+  { return find(key, std::hash<object>{}(key)); }
+
+  inline size_t shape::find(object const &key, size_t const hash) const
+  {
+    for(size_t i{}; i < hashes.size(); ++i)
+    {
+      if(hashes[i] == hash && keys[i] == key)
+      { return i; }
     }
-  };
+    return keys.size();
+  }
+}
+
+#ifdef JANK_PRELUDE_DEFINITIONS
+namespace jank::detail
+{
+  JANK_PRELUDE_FN keyword intern_keyword(std::string const &ns, std::string const &name)
+  {
+    static std::mutex table_mutex;
+    static std::unordered_map<std::string, std::unique_ptr<keyword::data>> table;
+
+    auto const full_name(ns.empty() ? name : ns + "/" + name);
+    std::lock_guard<std::mutex> const lock{ table_mutex };
+    auto &found(table[full_name]);
+    if(!found)
+    {
+      found = std::make_unique<keyword::data>
+      (keyword::data{ ns, name, std::hash<std::string>{}(":" + full_name) });
+    }
+    return { found.get() };
+  }
+
+  JANK_PRELUDE_FN shape::shape(std::initializer_list<object> const key_list)
+    /* Braces would make a vector of one key: the list itself. */
+    : keys(key_list)
+  {
+    static std::atomic<std::uint32_t> next_id{ 1 };
+    id = next_id.fetch_add(1, std::memory_order_relaxed);
+
+    hashes.reserve(keys.size());
+    for(auto const &key : keys)
+    { hashes.push_back(std::hash<object>{}(key)); }
+  }
+
+  JANK_PRELUDE_FN map record_to_map(record const &r)
+  {
+    map_transient ret;
+    for(size_t i{}; i < r.fields.size(); ++i)
+    { ret.set(r.record_shape->keys[i], r.fields[i]); }
+    return ret.persistent();
+  }
+
+  JANK_PRELUDE_FN bool operator==(record const &l, record const &r)
+  {
+    if(l.fields.size() != r.fields.size())
+    { return false; }
+    else if(l.record_shape == r.record_shape)
+    { return std::equal(l.fields.begin(), l.fields.end(), r.fields.begin()); }
+
+    for(size_t i{}; i < l.fields.size(); ++i)
+    {
+      auto const found(r.record_shape->find(l.record_shape->keys[i]));
+      if(found == r.record_shape->size() || r.fields[found] != l.fields[i])
+      { return false; }
+    }
+    return true;
+  }
+  JANK_PRELUDE_FN bool operator!=(record const &l, record const &r)
+  { return !(l == r); }
+
+  JANK_PRELUDE_FN bool operator==(record const &l, map const &r)
+  {
+    if(l.fields.size() != r.size())
+    { return false; }
+
+    for(size_t i{}; i < l.fields.size(); ++i)
+    {
+      auto const * const found(r.find(l.record_shape->keys[i]));
+      if(!found || *found != l.fields[i])
+      { return false; }
+    }
+    return true;
+  }
+  JANK_PRELUDE_FN bool operator!=(record const &l, map const &r)
+  { return !(l == r); }
+  JANK_PRELUDE_FN bool operator==(map const &l, record const &r)
+  { return r == l; }
+  JANK_PRELUDE_FN bool operator!=(map const &l, record const &r)
+  { return !(r == l); }
+}
+
+namespace jank
+{
+  JANK_PRELUDE_FN std::ostream& operator<<(std::ostream &os, object const &o)
+  {
+    switch(o.get_kind())
+    {
+      case object::kind::nil:
+        os << "nil";
+        break;
+      case object::kind::integer:
+        os << o.expect<detail::integer>();
+        break;
+      case object::kind::real:
+        os << o.expect<detail::real>();
+        break;
+      case object::kind::boolean:
+        os << (o.expect<detail::boolean>() ? "true" : "false");
+        break;
+      case object::kind::string:
+        os << "\"" << o.expect<detail::string>() << "\"";
+        break;
+      case object::kind::keyword:
+      {
+        auto const &interned(*o.expect<detail::keyword>().interned);
+        os << ":";
+        if(!interned.ns.empty())
+        { os << interned.ns << "/"; }
+        os << interned.name;
+        break;
+      }
+      case object::kind::vector:
+      {
+        auto const &data(o.expect<object::vector_type>());
+        os << "[";
+        std::copy
+        (
+          std::begin(data),
+          std::end(data),
+          std::experimental::make_ostream_joiner(os, " ")
+        );
+        os << "]";
+        break;
+      }
+      case object::kind::lazy_seq:
+      {
+        auto const &data(detail::realize(o.expect<object::lazy_seq_type>()));
+        os << "(";
+        std::copy
+        (
+          std::begin(data),
+          std::end(data),
+          std::experimental::make_ostream_joiner(os, " ")
+        );
+        os << ")";
+        break;
+      }
+      case object::kind::set:
+      {
+        auto const &data(o.expect<object::set_type>());
+        os << "#{";
+        std::copy
+        (
+          std::begin(data),
+          std::end(data),
+          std::experimental::make_ostream_joiner(os, " ")
+        );
+        os << "}";
+        break;
+      }
+      case object::kind::map:
+      {
+        auto const &data(o.expect<object::map_type>());
+        os << "{";
+        for(auto i(data.begin()); i != data.end(); ++i)
+        { os << i->first << " " << i->second << " "; }
+        os << "}";
+        break;
+      }
+      case object::kind::record:
+      {
+        auto const &data(o.expect<object::record_type>());
+        os << "{";
+        for(size_t i{}; i < data.fields.size(); ++i)
+        { os << data.record_shape->keys[i] << " " << data.fields[i] << " "; }
+        os << "}";
+        break;
+      }
+      case object::kind::function:
+        os << "<function>";
+        break;
+    }
+    return os;
+  }
 }
+#endif
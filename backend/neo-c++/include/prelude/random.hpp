@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+
+#include <prelude/object.hpp>
+#include <prelude/thread_pool.hpp>
+
+namespace jank::detail
+{
+  /* Expands a seed into generator state; consecutive outputs are uncorrelated
+   * even for similar seeds. */
+  inline uint64_t splitmix64(uint64_t &state)
+  {
+    uint64_t z{ state += 0x9e3779b97f4a7c15 };
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+  inline uint64_t rotl(uint64_t const x, int const k)
+  { return (x << k) | (x >> (64 - k)); }
+
+  /* xoshiro256**: 32 bytes of state, a handful of instructions per number,
+   * and jumps for splitting into independent streams. */
+  class xoshiro256
+  {
+    public:
+      using result_type = uint64_t;
+
+      explicit xoshiro256(uint64_t seed)
+      {
+        for(auto &word : state)
+        { word = splitmix64(seed); }
+      }
+
+      static constexpr result_type min()
+      { return 0; }
+      static constexpr result_type max()
+      { return UINT64_MAX; }
+
+      result_type operator()()
+      {
+        auto const result(rotl(state[1] * 5, 7) * 9);
+        auto const t(state[1] << 17);
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+      }
+
+      /* Uniform in [0, 1), using the top 53 bits. */
+      real next_real()
+      { return static_cast<real>((*this)() >> 11) * 0x1.0p-53; }
+
+      /* Uniform in [0, bound), by Lemire's multiply and shift. */
+      integer next_integer(integer const bound)
+      {
+        auto const wide(static_cast<unsigned __int128>((*this)()) * static_cast<uint64_t>(bound));
+        return static_cast<integer>(wide >> 64);
+      }
+
+      /* Advances by 2^128 numbers. Each jump starts a stream which won't
+       * overlap with the others. */
+      void jump()
+      {
+        static uint64_t constexpr polynomial[]
+        { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+
+        std::array<uint64_t, 4> jumped{};
+        for(auto const word : polynomial)
+        {
+          for(int b{}; b < 64; ++b)
+          {
+            if(word & (uint64_t{ 1 } << b))
+            {
+              for(size_t i{}; i < jumped.size(); ++i)
+              { jumped[i] ^= state[i]; }
+            }
+            (*this)();
+          }
+        }
+        state = jumped;
+      }
+
+    private:
+      std::array<uint64_t, 4> state{};
+  };
+
+  inline uint64_t initial_random_seed()
+  {
+    if(auto const * const env = std::getenv("JANK_SEED"))
+    { return std::strtoull(env, nullptr, 10); }
+    /* "jank" */
+    return 0x6a616e6b;
+  }
+  inline std::atomic<uint64_t>& random_seed()
+  {
+    static std::atomic<uint64_t> seed{ initial_random_seed() };
+    return seed;
+  }
+  /* Bumped whenever the seed is set, so that every thread knows to reseed. */
+  inline std::atomic<uint64_t>& random_generation()
+  {
+    static std::atomic<uint64_t> generation{};
+    return generation;
+  }
+  inline void seed_random(uint64_t const seed)
+  {
+    random_seed().store(seed, std::memory_order_relaxed);
+    random_generation().fetch_add(1, std::memory_order_release);
+  }
+
+  /* The stream for one index of parallel work. It's only made if something
+   * draws from it. */
+  struct task_stream
+  {
+    uint64_t seed{};
+    std::optional<xoshiro256> generator;
+  };
+
+  struct thread_random
+  {
+    /* Used outside of parallel work. Pool workers always get the same
+     * stream, based on their index, and every other thread gets the first. */
+    xoshiro256 generator{ 0 };
+    uint64_t generation{ static_cast<uint64_t>(-1) };
+    /* Set while this thread runs an index of parallel work. */
+    task_stream *task{};
+  };
+  inline thread_random& thread_random_state()
+  {
+    thread_local thread_random state;
+    return state;
+  }
+
+  inline xoshiro256& thread_generator()
+  {
+    auto &state(thread_random_state());
+    if(state.task)
+    {
+      auto &task(*state.task);
+      if(!task.generator)
+      { task.generator.emplace(task.seed); }
+      return *task.generator;
+    }
+
+    auto const generation(random_generation().load(std::memory_order_acquire));
+    if(state.generation != generation)
+    {
+      state.generator = xoshiro256{ random_seed().load(std::memory_order_relaxed) };
+      auto const worker(thread_pool::current_worker());
+      auto const stream(worker == thread_pool::no_worker ? 0 : worker + 1);
+      for(size_t i{}; i < stream; ++i)
+      { state.generator.jump(); }
+      state.generation = generation;
+    }
+    return state.generator;
+  }
+
+  /* Parallel work gives each index its own stream, derived from a base which
+   * the caller draws up front. So what each index draws depends only on the
+   * seed and the index, not on which thread runs it, or on how the work is
+   * chunked, and seeded runs are reproducible. */
+  inline uint64_t task_random_base()
+  { return thread_generator()(); }
+
+  class task_random_scope
+  {
+    public:
+      task_random_scope(uint64_t base, size_t const index)
+        : previous{ thread_random_state().task }
+      {
+        base += index * 0x9e3779b97f4a7c15;
+        stream.seed = splitmix64(base);
+        thread_random_state().task = &stream;
+      }
+      task_random_scope(task_random_scope const &) = delete;
+      ~task_random_scope()
+      { thread_random_state().task = previous; }
+
+    private:
+      task_stream stream;
+      /* Threads which wait on parallel work help to run it, so scopes nest. */
+      task_stream * const previous;
+  };
+
+  /* Builds for baseline x86-64 only have two 64 bit lanes per vector, which
+   * isn't enough to beat the scalar generator. So the bulk loop is also
+   * compiled for AVX2, and the best version is picked when the program
+   * loads. */
+#if defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__)
+  #define JANK_BULK_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+  #define JANK_BULK_CLONES
+#endif
+
+  /* Generates reals in bulk using several generators in lockstep, with their
+   * state laid out by lane, so the compiler can vectorize the loop. */
+  class bulk_generator
+  {
+    public:
+      static size_t constexpr lanes{ 8 };
+      using state_type = uint64_t[4][lanes];
+
+      explicit bulk_generator(xoshiro256 &seeder)
+      {
+        for(size_t l{}; l < lanes; ++l)
+        {
+          auto seed(seeder());
+          for(auto &word : state)
+          { word[l] = splitmix64(seed); }
+        }
+      }
+
+      void fill(real * const out, size_t const count)
+      { fill(state, out, count); }
+
+    private:
+      /* Vector units often lack 64 bit multiplies and integer to real
+       * conversions, so this sticks to shifts and adds. The real is made by
+       * putting 52 random bits into the mantissa of a number in [1, 2). The
+       * state is copied into locals, so it can stay in registers. */
+      JANK_BULK_CLONES
+      static void fill(state_type &state, real * const out, size_t const count)
+      {
+        state_type s;
+        std::memcpy(s, state, sizeof(s));
+
+        for(size_t i{}; i < count; i += lanes)
+        {
+          /* The last few, if any, go through a buffer. */
+          real tail[lanes];
+          auto * const next(i + lanes <= count ? out + i : tail);
+          for(size_t l{}; l < lanes; ++l)
+          {
+            auto const s1(s[1][l]);
+            auto const times5(s1 + (s1 << 2));
+            auto const rotated(rotl(times5, 7));
+            auto const result(rotated + (rotated << 3));
+            auto const t(s1 << 17);
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s1;
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = rotl(s[3][l], 45);
+
+            auto const bits((result >> 12) | 0x3ff0000000000000);
+            real r;
+            std::memcpy(&r, &bits, sizeof(r));
+            next[l] = r - 1.0;
+          }
+          if(next == tail)
+          { std::copy(tail, tail + (count - i), out + i); }
+        }
+
+        std::memcpy(state, s, sizeof(s));
+      }
+
+      state_type state{};
+  };
+
+  /* Fills the buffer with reals uniform in [0, 1), drawn from the current
+   * stream, so parallel work stays reproducible. Small buffers aren't worth
+   * seeding the lanes for. */
+  inline void fill_reals(real * const out, size_t const count)
+  {
+    auto &generator(thread_generator());
+    if(count < bulk_generator::lanes * 4)
+    {
+      for(size_t i{}; i < count; ++i)
+      { out[i] = generator.next_real(); }
+      return;
+    }
+
+    bulk_generator{ generator }.fill(out, count);
+  }
+}
@@ -1,13 +1,146 @@
 #pragma once
 
+#include <prelude/library.hpp>
 #include <prelude/object.hpp>
+#include <prelude/lazy.hpp>
+#include <prelude/thread_pool.hpp>
+#include <prelude/random.hpp>
 
 namespace jank
 {
-  /* TODO: Laziness. */
-  inline object mapv(object const &f, object const &seq)
+  object mapv(object const &f, object const &seq);
+  /* Lazy seqs are reduced in one loop, without realizing them. */
+  object reduce(object const &f, object const &initial, object const &seq);
+
+  namespace detail
   {
-    return seq.visit
+    std::vector<object> gather(object const &seq, bool &seqable);
+
+    /* Reduces chunks of this size in parallel. It's fixed, rather than based
+     * on the number of cores, so that results don't depend on the machine. */
+    size_t constexpr preduce_chunk_size{ 512 };
+  }
+
+  /* Like mapv, but f is called in parallel. The results keep their order. */
+  object pmapv(object const &f, object const &seq);
+  /* Reduces chunks of the seq in parallel, each starting from initial, and
+   * then combines the chunks' results, in order. */
+  object preduce
+  (object const &f, object const &combine, object const &initial, object const &seq);
+  object map(object const &f, object const &seq);
+  object filter(object const &pred, object const &seq);
+  /* TODO: Laziness */
+  object partition(object const &n, object const &seq);
+  object range(object const &start, object const &end);
+  object reverse(object const &seq);
+  object rand_gen_minus_nth(object const &seq);
+
+  namespace detail
+  {
+    /* Like get, but refers to the value within the collection, rather than
+     * copying it out. The reference is only valid while the collection is. */
+    inline object const& vector_get_ref(vector const &data, object const &key)
+    {
+      if(key.get_kind() != object::kind::integer)
+      { return JANK_NIL; }
+
+      auto const i(*key.get<integer>());
+      if(i < 0 || i >= data.size())
+      { return JANK_NIL; }
+
+      return data[i];
+    }
+
+    inline object const& get_ref(object const &o, object const &key)
+    {
+      switch(o.get_kind())
+      {
+        case object::kind::vector:
+        { return vector_get_ref(o.expect<vector>(), key); }
+        /* Lazy seqs keep what they realize, so the reference is valid for as
+         * long as the seq is. */
+        case object::kind::lazy_seq:
+        { return vector_get_ref(realize(o.expect<lazy_seq>()), key); }
+        case object::kind::map:
+        {
+          auto const &data(o.expect<map>());
+          if(auto * const found = data.find(key))
+          { return *found; }
+          else
+          { return JANK_NIL; }
+        }
+        case object::kind::record:
+        {
+          auto const &data(o.expect<record>());
+          auto const i(data.record_shape->find(key));
+          if(i == data.record_shape->size())
+          { return JANK_NIL; }
+
+          return data.fields[i];
+        }
+        default:
+        {
+          /* TODO: throw error */
+          std::cout << "can only call get on associative types" << std::endl;
+          return JANK_NIL;
+        }
+      }
+    }
+  }
+
+  inline object get(object const &o, object const &key)
+  { return detail::get_ref(o, key); }
+
+  namespace detail
+  {
+    /* Each get with a constant key gets one of these, as a static. The key's
+     * hash is computed once, up front, and the last record shape which was
+     * looked up, along with the key's field within it, is kept as a hint, so
+     * that more records of that shape need neither hashing nor comparing.
+     * Maps are still looked up by the key itself, since immer hashes it. */
+    struct get_cache
+    {
+      explicit get_cache(object const &k)
+        : key{ k }, hash{ std::hash<object>{}(k) }
+      { }
+
+      object const key;
+      size_t const hash;
+      /* The shape's id, in the high half, and the field, in the low half.
+       * They share one word so that threads sharing the call site never see
+       * one without the other. */
+      std::atomic<std::uint64_t> hint{};
+    };
+
+    inline object const& get_ref(object const &o, get_cache &cache)
+    {
+      if(o.get_kind() != object::kind::record)
+      { return get_ref(o, cache.key); }
+
+      auto const &data(o.expect<record>());
+      auto const &s(*data.record_shape);
+      auto const hint(cache.hint.load(std::memory_order_relaxed));
+      size_t field(hint & 0xffffffff);
+      if((hint >> 32) != s.id)
+      {
+        /* Missing keys are remembered too, as size(). */
+        field = s.find(cache.key, cache.hash);
+        cache.hint.store
+        ((std::uint64_t{ s.id } << 32) | field, std::memory_order_relaxed);
+      }
+
+      if(field == s.size())
+      { return JANK_NIL; }
+      return data.fields[field];
+    }
+  }
+
+  inline object conj(object const &o, object const &val)
+  {
+    if(o.get_kind() == object::kind::lazy_seq)
+    { return conj(object{ detail::realize(o.expect<detail::lazy_seq>()) }, val); }
+
+    return o.visit
     (
       [&](auto const &data) -> object
       {
@@ -15,33 +148,12 @@ namespace jank
         /* TODO: Generic seq handling. */
         auto constexpr is_vector(std::is_same_v<T, detail::vector>);
         auto constexpr is_set(std::is_same_v<T, detail::set>);
-        auto constexpr is_map(std::is_same_v<T, detail::map>);
-
-        if constexpr(is_vector || is_set || is_map)
-        {
-          auto const * const func_ptr(detail::extract_function<object const*, object>(&f));
-          if(!func_ptr)
-          {
-            /* TODO: Throw an error. */
-            std::cout << "not a function: " << f << std::endl;
-            return JANK_NIL;
-          }
 
-          detail::vector_transient ret;
-
-          if constexpr(is_vector || is_set)
-          {
-            for(auto const &e : data)
-            { ret.push_back((*func_ptr)(e)); }
-          }
-          else if constexpr(is_map)
-          {
-            for(auto const &p : data)
-            { ret.push_back((*func_ptr)(object{ detail::vector{ p.first, p.second } })); }
-          }
-
-          return object{ ret.persistent() };
-        }
+        /* TODO: Map support. */
+        if constexpr(is_vector)
+        { return object{ data.push_back(val) }; }
+        else if constexpr(is_set)
+        { return object{ data.insert(val) }; }
         else
         {
           /* TODO: Throw an error. */
@@ -52,33 +164,50 @@ namespace jank
     );
   }
 
-  inline object reduce(object const &f, object const &initial, object const &seq)
+  inline object assoc(object const &o, object const &key, object const &val)
   {
-    return seq.visit
+    if(o.get_kind() == object::kind::lazy_seq)
+    { return assoc(object{ detail::realize(o.expect<detail::lazy_seq>()) }, key, val); }
+
+    return o.visit
     (
       [&](auto const &data) -> object
       {
         using T = std::decay_t<decltype(data)>;
         /* TODO: Generic seq handling. */
         auto constexpr is_vector(std::is_same_v<T, detail::vector>);
-        auto constexpr is_set(std::is_same_v<T, detail::set>);
+        auto constexpr is_map(std::is_same_v<T, detail::map>);
+        auto constexpr is_record(std::is_same_v<T, detail::record>);
 
-        if constexpr(is_vector || is_set)
+        if constexpr(is_vector)
         {
-          auto const * const func_ptr(detail::extract_function<object const*, object, object>(&f));
-          if(!func_ptr)
+          if(key.get_kind() != object::kind::integer)
           {
-            /* TODO: Throw an error. */
-            std::cout << "not a function: " << f << std::endl;
+            /* TODO: throw error */
+            std::cout << "vector assoc key must be an integer: " << key << std::endl;
             return JANK_NIL;
           }
 
-          object acc{ initial };
+          auto const i(*key.get<detail::integer>());
+          if(i < 0 || i >= data.size())
+          {
+            /* TODO: Throw error */
+            std::cout << "vector assoc key out of bounds: " << key << std::endl;
+            return JANK_NIL;
+          }
 
-          for(auto const &e : data)
-          { acc = (*func_ptr)(acc, e); }
+          return object{ data.set(i, val) };
+        }
+        else if constexpr(is_map)
+        { return object{ data.set(key, val) }; }
+        else if constexpr(is_record)
+        {
+          /* Only new keys change the shape. */
+          auto const i(data.record_shape->find(key));
+          if(i == data.record_shape->size())
+          { return object{ detail::record_to_map(data).set(key, val) }; }
 
-          return acc;
+          return object{ detail::record{ data.record_shape, data.fields.set(i, val) } };
         }
         else
         {
@@ -89,10 +218,220 @@ namespace jank
       }
     );
   }
+}
 
-  /* TODO: Laziness */
-  inline object partition(object const &n, object const &seq)
+#ifdef JANK_PRELUDE_DEFINITIONS
+namespace jank
+{
+  JANK_PRELUDE_FN object mapv(object const &f, object const &seq)
+  {
+    auto const * const func_ptr(detail::extract_function<object const*, object>(&f));
+    if(!func_ptr)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a function: " << f << std::endl;
+      return JANK_NIL;
+    }
+
+    detail::vector_transient ret;
+    auto const seqable
+    (
+      detail::each
+      (
+        seq,
+        [&](object const &e)
+        {
+          ret.push_back((*func_ptr)(e));
+          return true;
+        }
+      )
+    );
+    if(!seqable)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a seq" << std::endl;
+      return JANK_NIL;
+    }
+
+    return object{ ret.persistent() };
+  }
+
+  JANK_PRELUDE_FN object reduce(object const &f, object const &initial, object const &seq)
+  {
+    auto const * const func_ptr(detail::extract_function<object const*, object, object>(&f));
+    if(!func_ptr)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a function: " << f << std::endl;
+      return JANK_NIL;
+    }
+
+    object acc{ initial };
+    auto const seqable
+    (
+      detail::each
+      (
+        seq,
+        [&](object const &e)
+        {
+          acc = (*func_ptr)(acc, e);
+          return true;
+        }
+      )
+    );
+    if(!seqable)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a seq" << std::endl;
+      return JANK_NIL;
+    }
+
+    return acc;
+  }
+
+  namespace detail
+  {
+    JANK_PRELUDE_FN std::vector<object> gather(object const &seq, bool &seqable)
+    {
+      std::vector<object> ret;
+      seqable = each
+      (
+        seq,
+        [&](object const &e)
+        {
+          ret.push_back(e);
+          return true;
+        }
+      );
+      return ret;
+    }
+  }
+
+  JANK_PRELUDE_FN object pmapv(object const &f, object const &seq)
   {
+    auto const * const func_ptr(detail::extract_function<object const*, object>(&f));
+    if(!func_ptr)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a function: " << f << std::endl;
+      return JANK_NIL;
+    }
+
+    bool seqable{};
+    auto const inputs(detail::gather(seq, seqable));
+    if(!seqable)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a seq" << std::endl;
+      return JANK_NIL;
+    }
+
+    std::vector<object> outputs(inputs.size());
+    /* Single threaded programs never start the pool, so chunks don't matter. */
+    auto const chunk_size
+    (
+      detail::single_threaded
+      ? std::max<size_t>(1, inputs.size())
+      : std::max<size_t>(1, inputs.size() / (detail::thread_pool::instance().size() * 4))
+    );
+    auto const random_base(detail::task_random_base());
+    detail::parallel_for
+    (
+      inputs.size(),
+      chunk_size,
+      [&](size_t const i)
+      {
+        detail::task_random_scope const random{ random_base, i };
+        outputs[i] = (*func_ptr)(inputs[i]);
+      }
+    );
+
+    detail::vector_transient ret;
+    for(auto &o : outputs)
+    { ret.push_back(std::move(o)); }
+    return object{ ret.persistent() };
+  }
+
+  JANK_PRELUDE_FN object preduce
+  (object const &f, object const &combine, object const &initial, object const &seq)
+  {
+    auto const * const func_ptr(detail::extract_function<object const*, object, object>(&f));
+    auto const * const combine_ptr
+    (detail::extract_function<object const*, object, object>(&combine));
+    if(!func_ptr || !combine_ptr)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a function: " << (func_ptr ? combine : f) << std::endl;
+      return JANK_NIL;
+    }
+
+    bool seqable{};
+    auto const inputs(detail::gather(seq, seqable));
+    if(!seqable)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a seq" << std::endl;
+      return JANK_NIL;
+    }
+    else if(inputs.empty())
+    { return initial; }
+
+    auto const chunks
+    ((inputs.size() + detail::preduce_chunk_size - 1) / detail::preduce_chunk_size);
+    std::vector<object> results(chunks);
+    auto const random_base(detail::task_random_base());
+    detail::parallel_for
+    (
+      chunks,
+      1,
+      [&](size_t const chunk)
+      {
+        detail::task_random_scope const random{ random_base, chunk };
+        object acc{ initial };
+        auto const end(std::min(inputs.size(), (chunk + 1) * detail::preduce_chunk_size));
+        for(auto i(chunk * detail::preduce_chunk_size); i < end; ++i)
+        { acc = (*func_ptr)(acc, inputs[i]); }
+        results[chunk] = std::move(acc);
+      }
+    );
+
+    object ret{ std::move(results[0]) };
+    for(size_t i{ 1 }; i < results.size(); ++i)
+    { ret = (*combine_ptr)(ret, results[i]); }
+    return ret;
+  }
+
+  JANK_PRELUDE_FN object map(object const &f, object const &seq)
+  {
+    auto const * const func_ptr(detail::extract_function<object const*, object>(&f));
+    if(!func_ptr)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a function: " << f << std::endl;
+      return JANK_NIL;
+    }
+
+    return detail::make_lazy_seq<detail::map_node>(*func_ptr, seq);
+  }
+
+  JANK_PRELUDE_FN object filter(object const &pred, object const &seq)
+  {
+    auto const * const func_ptr(detail::extract_function<object const*, object>(&pred));
+    if(!func_ptr)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a function: " << pred << std::endl;
+      return JANK_NIL;
+    }
+
+    return detail::make_lazy_seq<detail::filter_node>(*func_ptr, seq);
+  }
+
+  JANK_PRELUDE_FN object partition(object const &n, object const &seq)
+  {
+    if(seq.get_kind() == object::kind::lazy_seq)
+    { return partition(n, detail::realize(seq.expect<detail::lazy_seq>())); }
+
     if(n.get_kind() != object::kind::integer)
     {
       /* TODO: throw error */
@@ -137,8 +476,7 @@ namespace jank
     );
   }
 
-  /* TODO: Laziness */
-  inline object range(object const &start, object const &end)
+  JANK_PRELUDE_FN object range(object const &start, object const &end)
   {
     if(start.get_kind() != object::kind::integer
        || end.get_kind() != object::kind::integer)
@@ -154,17 +492,15 @@ namespace jank
       return JANK_NIL;
     }
 
-    auto const start_int(*start.get<detail::integer>());
-    auto const end_int(*end.get<detail::integer>());
-
-    detail::vector_transient ret;
-    for(auto i(start_int); i < end_int; ++i)
-    { ret.push_back(i); }
-    return ret.persistent();
+    return detail::make_lazy_seq<detail::range_node>
+    (*start.get<detail::integer>(), *end.get<detail::integer>());
   }
 
-  inline object reverse(object const &seq)
+  JANK_PRELUDE_FN object reverse(object const &seq)
   {
+    if(seq.get_kind() == object::kind::lazy_seq)
+    { return reverse(detail::realize(seq.expect<detail::lazy_seq>())); }
+
     return seq.visit
     (
       [&](auto const &data) -> object
@@ -192,102 +528,37 @@ namespace jank
     );
   }
 
-  /* TODO: This is too slow, due to copying out of the object. */
-  inline object get(object const &o, object const &key)
+  JANK_PRELUDE_FN object rand_gen_minus_nth(object const &seq)
   {
-    switch(o.get_kind())
+    if(seq.get_kind() == object::kind::vector)
     {
-      case object::kind::vector:
-      {
-        if(key.get_kind() != object::kind::integer)
-        { return JANK_NIL; }
-
-        auto const &data(o.expect<detail::vector>());
-        auto const i(*key.get<detail::integer>());
-        if(i < 0 || i >= data.size())
-        { return JANK_NIL; }
-
-        return data[i];
-      }
-      case object::kind::map:
-      {
-        auto const &data(o.expect<detail::map>());
-        if(auto * const found = data.find(key))
-        { return *found; }
-        else
-        { return JANK_NIL; }
-      }
-      default:
+      auto const &data(seq.expect<detail::vector>());
+      if(data.empty())
       {
-        /* TODO: throw error */
-        std::cout << "can only call get on associative types" << std::endl;
+        /* TODO: Throw an error. */
+        std::cout << "rand-nth of an empty seq" << std::endl;
         return JANK_NIL;
       }
-    }
-  }
 
-  inline object conj(object const &o, object const &val)
-  {
-    return o.visit
-    (
-      [&](auto const &data) -> object
-      {
-        using T = std::decay_t<decltype(data)>;
-        /* TODO: Generic seq handling. */
-        auto constexpr is_vector(std::is_same_v<T, detail::vector>);
-
-        /* TODO: Map support. */
-        if constexpr(is_vector)
-        { return object{ data.push_back(val) }; }
-        else
-        {
-          /* TODO: Throw an error. */
-          std::cout << "not a seq" << std::endl;
-          return JANK_NIL;
-        }
-      }
-    );
-  }
-
-  inline object assoc(object const &o, object const &key, object const &val)
-  {
-    return o.visit
-    (
-      [&](auto const &data) -> object
-      {
-        using T = std::decay_t<decltype(data)>;
-        /* TODO: Generic seq handling. */
-        auto constexpr is_vector(std::is_same_v<T, detail::vector>);
-        auto constexpr is_map(std::is_same_v<T, detail::map>);
-
-        if constexpr(is_vector)
-        {
-          if(key.get_kind() != object::kind::integer)
-          {
-            /* TODO: throw error */
-            std::cout << "vector assoc key must be an integer: " << key << std::endl;
-            return JANK_NIL;
-          }
+      return data[detail::thread_generator().next_integer(data.size())];
+    }
 
-          auto const i(*key.get<detail::integer>());
-          if(i < 0 || i >= data.size())
-          {
-            /* TODO: Throw error */
-            std::cout << "vector assoc key out of bounds: " << key << std::endl;
-            return JANK_NIL;
-          }
+    bool seqable{};
+    auto const elements(detail::gather(seq, seqable));
+    if(!seqable)
+    {
+      /* TODO: Throw an error. */
+      std::cout << "not a seq" << std::endl;
+      return JANK_NIL;
+    }
+    else if(elements.empty())
+    {
+      /* TODO: Throw an error. */
+      std::cout << "rand-nth of an empty seq" << std::endl;
+      return JANK_NIL;
+    }
 
-          return object{ data.set(i, val) };
-        }
-        else if constexpr(is_map)
-        { return object{ data.set(key, val) }; }
-        else
-        {
-          /* TODO: Throw an error. */
-          std::cout << "not a seq" << std::endl;
-          return JANK_NIL;
-        }
-      }
-    );
+    return elements[detail::thread_generator().next_integer(elements.size())];
   }
 }
+#endif
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <prelude/memory.hpp>
+
+namespace jank::detail
+{
+  /* One worker per core, each with its own queue of tasks. Workers take from
+   * the back of their own queue and, once it's empty, steal from the front of
+   * the others'. Threads which are waiting on tasks help to run them, so
+   * parallel work can nest without running out of workers. */
+  class thread_pool
+  {
+    public:
+      using task = std::function<void ()>;
+      static size_t constexpr no_worker{ static_cast<size_t>(-1) };
+
+      static thread_pool& instance()
+      {
+        static thread_pool pool;
+        return pool;
+      }
+
+      explicit thread_pool(size_t const worker_count = default_worker_count())
+      {
+#ifdef JANK_GC
+        GC_allow_register_threads();
+#endif
+        for(size_t i{}; i < worker_count; ++i)
+        { queues.emplace_back(std::make_unique<queue>()); }
+        for(size_t i{}; i < worker_count; ++i)
+        { workers.emplace_back([this, i]{ work(i); }); }
+      }
+      thread_pool(thread_pool const &) = delete;
+      ~thread_pool()
+      {
+        {
+          std::lock_guard<std::mutex> const lock{ sleep_mutex };
+          stopping = true;
+        }
+        sleep_condition.notify_all();
+        for(auto &worker : workers)
+        { worker.join(); }
+      }
+
+      size_t size() const
+      { return workers.size(); }
+
+      /* The index of the calling worker, or no_worker, if it's not one. */
+      static size_t current_worker()
+      { return worker_index; }
+
+      void submit(task t)
+      {
+        /* Workers keep their own tasks, since they're likely to run them
+         * next. Everyone else spreads them around. */
+        auto const index
+        (
+          worker_index < queues.size()
+          ? worker_index
+          : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size()
+        );
+        {
+          std::lock_guard<std::mutex> const lock{ queues[index]->mutex };
+          queues[index]->tasks.push_back(std::move(t));
+        }
+
+        pending.fetch_add(1, std::memory_order_release);
+        { std::lock_guard<std::mutex> const lock{ sleep_mutex }; }
+        sleep_condition.notify_one();
+      }
+
+      /* Runs one pending task, if there are any. */
+      bool run_one()
+      {
+        task t;
+        if(!pop(t))
+        { return false; }
+
+        t();
+        return true;
+      }
+
+    private:
+      struct queue
+      {
+        std::mutex mutex;
+        std::deque<task> tasks;
+      };
+
+      static size_t default_worker_count()
+      { return std::max(1u, std::thread::hardware_concurrency()); }
+
+      bool pop(task &t)
+      {
+        auto const own(worker_index < queues.size() ? worker_index : 0);
+        for(size_t i{}; i < queues.size(); ++i)
+        {
+          auto &q(*queues[(own + i) % queues.size()]);
+          std::lock_guard<std::mutex> const lock{ q.mutex };
+          if(q.tasks.empty())
+          { continue; }
+
+          if(i == 0 && worker_index < queues.size())
+          {
+            t = std::move(q.tasks.back());
+            q.tasks.pop_back();
+          }
+          else
+          {
+            t = std::move(q.tasks.front());
+            q.tasks.pop_front();
+          }
+          pending.fetch_sub(1, std::memory_order_relaxed);
+          return true;
+        }
+        return false;
+      }
+
+      void work(size_t const index)
+      {
+        worker_index = index;
+#ifdef JANK_GC
+        /* The collector needs to scan the stacks of workers, which it only
+         * knows about once they're registered. */
+        GC_stack_base stack_base;
+        GC_get_stack_base(&stack_base);
+        GC_register_my_thread(&stack_base);
+        struct unregister
+        {
+          ~unregister()
+          { GC_unregister_my_thread(); }
+        } const unregister_on_exit;
+#endif
+        while(true)
+        {
+          if(run_one())
+          { continue; }
+
+          std::unique_lock<std::mutex> lock{ sleep_mutex };
+          sleep_condition.wait
+          (
+            lock,
+            [this]
+            { return stopping || pending.load(std::memory_order_acquire) > 0; }
+          );
+          if(stopping)
+          { return; }
+        }
+      }
+
+      /* There's only the one pool, so a worker's index is all it needs. */
+      static inline thread_local size_t worker_index{ no_worker };
+
+      std::vector<std::unique_ptr<queue>> queues;
+      std::vector<std::thread> workers;
+      std::atomic<size_t> next_queue{};
+      std::atomic<size_t> pending{};
+      std::mutex sleep_mutex;
+      std::condition_variable sleep_condition;
+      bool stopping{};
+  };
+
+  /* Calls f with every index in [0, count), in chunks spread across the pool.
+   * Returns once every call is done, rethrowing the first exception, if any.
+   * Single threaded programs just make the calls, in order, without the pool. */
+  template <typename F>
+  void parallel_for(size_t const count, size_t const chunk_size, F const &f)
+  {
+    if constexpr(single_threaded)
+    {
+      for(size_t i{}; i < count; ++i)
+      { f(i); }
+      return;
+    }
+
+    auto &pool(thread_pool::instance());
+    auto const chunks((count + chunk_size - 1) / chunk_size);
+    std::atomic<size_t> remaining{ chunks };
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    for(size_t chunk{}; chunk < chunks; ++chunk)
+    {
+      pool.submit
+      (
+        [&, chunk]
+        {
+          try
+          {
+            auto const end(std::min(count, (chunk + 1) * chunk_size));
+            for(auto i(chunk * chunk_size); i < end; ++i)
+            { f(i); }
+          }
+          catch(...)
+          {
+            std::lock_guard<std::mutex> const lock{ error_mutex };
+            if(!error)
+            { error = std::current_exception(); }
+          }
+          remaining.fetch_sub(1, std::memory_order_release);
+        }
+      );
+    }
+
+    while(remaining.load(std::memory_order_acquire) > 0)
+    {
+      if(!pool.run_one())
+      { std::this_thread::yield(); }
+    }
+
+    if(error)
+    { std::rethrow_exception(error); }
+  }
+}
@@ -1,8 +1,10 @@
+/* The prelude comes first, so that it can be precompiled. */
+#include "prelude.hpp"
+
 #include <stdexcept>
+#include <string>
 #include <iostream>
 
-#include "prelude.hpp"
-
 namespace jank
 {
 /* This is the generated source. */
@@ -12,7 +14,22 @@ namespace jank
 int main(int const argc, char ** const argv)
 try
 {
+#ifdef JANK_GC
+  GC_INIT();
+#endif
+
+  /* --seed overrides JANK_SEED, so runs can be reproduced. */
+  for(int i{ 1 }; i + 1 < argc; ++i)
+  {
+    if(std::string{ argv[i] } == "--seed")
+    { jank::detail::seed_random(std::stoull(argv[i + 1])); }
+  }
+
   jank::_gen_poundmain();
+
+#ifdef JANK_ALLOCATION_STATS
+  jank::detail::allocation_stats::instance().report(std::cerr);
+#endif
 }
 catch(std::exception const &e)
 { std::cout << "exception: " << e.what() << std::endl; }
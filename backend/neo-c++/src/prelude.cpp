@@ -0,0 +1,5 @@
+/* The out of line half of the prelude, for builds with JANK_PRELUDE_LIBRARY.
+ * bin/jank compiles this into a static library, once for each set of flags,
+ * and links every program against it. See prelude/library.hpp. */
+#define JANK_PRELUDE_IMPLEMENTATION
+#include "prelude.hpp"
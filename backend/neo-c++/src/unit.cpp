@@ -0,0 +1,17 @@
+/* Each generated translation unit is built from this, with JANK_UNIT naming
+ * the generated source. Like main.cpp, it includes the prelude first, so that
+ * it can be precompiled, and then the generated header, which declares
+ * everything the units share. */
+#include "prelude.hpp"
+
+#ifndef JANK_UNIT
+#error "JANK_UNIT needs to name the generated unit"
+#endif
+
+namespace jank
+{
+#include "jank-generated.hpp"
+
+/* This is the generated source. */
+#include JANK_UNIT
+}
@@ -0,0 +1,87 @@
+(ns com.jeaye.jank.benchmark.inference
+  "Type inference time on synthetic programs of increasing size, to show how
+   it scales. Run from the repo root with:
+
+     lein run -m com.jeaye.jank.benchmark.inference [runs]
+
+   Results are JSON lines on stdout, like those of bin/benchmark. If
+   inference scales linearly, the time per def stays flat as programs grow."
+  (:require [clojure.string]
+            [com.jeaye.jank.parse :as parse]
+            [com.jeaye.jank.parse.binding :as parse.binding]
+            [com.jeaye.jank.fold.core :as fold.core]
+            [com.jeaye.jank.inference.core :as inference.core]))
+
+(def sizes
+  "How many groups of defs each program has."
+  [125 250 500 1000 2000])
+
+(def let-depth
+  "How many bindings each let has, each depending on the ones before it."
+  20)
+
+(defn generate-group
+  "A fn, another fn which calls it through a chain of numeric let bindings,
+   and a call to that, which calls into the group before it too."
+  [k]
+  (let [bindings (->> (range 2 let-depth)
+                      (map (fn [i]
+                             (format "x%d (%s x%d x%d)"
+                                     i
+                                     (["+" "-" "*"] (mod i 3))
+                                     (dec i)
+                                     (- i 2))))
+                      (clojure.string/join "\n        "))
+        last-binding (str "x" (dec let-depth))]
+    (format (str "(def f%d (fn [a b] (+ (* a b) %d)))\n"
+                 "(def g%d (fn [n]\n"
+                 "  (let [x0 (f%d n 2)\n"
+                 "        x1 (+ x0 1.5)\n"
+                 "        %s]\n"
+                 "    (if (< %s 0.0)\n"
+                 "      (f%d %s n)\n"
+                 "      %s))))\n"
+                 "(def v%d (g%d %d))\n")
+            k k
+            k
+            k
+            bindings
+            last-binding
+            (max 0 (dec k)) last-binding
+            last-binding
+            k k k)))
+
+(defn generate-program [groups]
+  (clojure.string/join "\n" (map generate-group (range groups))))
+
+(defn prepare
+  "Parses and folds the program, which is all inference needs."
+  [source]
+  (binding [parse.binding/*input-file* "benchmark"
+            parse.binding/*input-source* source]
+    (fold.core/fold (parse/parse parse/prelude))))
+
+(defn milliseconds [f]
+  (let [start (System/nanoTime)]
+    (f)
+    (/ (- (System/nanoTime) start) 1e6)))
+
+(defn -main [& [runs]]
+  (let [runs (Long/parseLong (or runs "5"))]
+    (doseq [groups sizes]
+      (let [folded (prepare (generate-program groups))
+            defs (* 3 groups)
+            infer #(dorun (inference.core/infer folded))
+            _ (infer)
+            times (sort (repeatedly runs #(milliseconds infer)))
+            median (nth times (quot runs 2))]
+        (println (format (str "{\"suite\": \"inference\", \"name\": \"%d defs\", \"unit\": \"ms\", "
+                              "\"median\": %.1f, \"min\": %.1f, \"max\": %.1f, \"runs\": %d, "
+                              "\"ms-per-def\": %.3f}")
+                         defs
+                         median
+                         (first times)
+                         (last times)
+                         runs
+                         (/ median defs)))
+        (flush)))))
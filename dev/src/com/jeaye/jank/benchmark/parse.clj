@@ -0,0 +1,75 @@
+(ns com.jeaye.jank.benchmark.parse
+  "Parse throughput, on sources generated from the parse test corpus, the jank
+   benchmarks, and ray.jank. Run from the repo root with:
+
+     lein run -m com.jeaye.jank.benchmark.parse [megabytes] [runs]
+
+   Results are JSON lines on stdout, like those of bin/benchmark."
+  (:require [clojure.java.io :as io]
+            [clojure.string]
+            [instaparse.core :as insta]
+            [com.jeaye.jank.parse :as parse]
+            [com.jeaye.jank.parse
+             [binding :as parse.binding]
+             [reader :as parse.reader]]))
+
+(defn corpus
+  "The source of every passing parse test, each benchmark, and ray.jank."
+  []
+  (->> (concat (file-seq (io/file "dev/resources/test/neo-parse"))
+               (file-seq (io/file "dev/resources/neo-benchmark"))
+               [(io/file "ray.jank")])
+       (filter #(and (.isFile %)
+                     (clojure.string/ends-with? (.getName %) ".jank")
+                     (not (clojure.string/starts-with? (.getName %) "fail-"))))
+       (sort-by #(.getPath %))
+       (map slurp)))
+
+(defn generate-source
+  "Repeats the corpus until it's at least the given number of bytes."
+  [size]
+  (let [sb (StringBuilder.)]
+    (doseq [source (cycle (corpus))
+            :while (< (.length sb) size)]
+      (.append sb ^String source)
+      (.append sb "\n"))
+    (str sb)))
+
+(defn seconds [f]
+  (let [start (System/nanoTime)]
+    (f)
+    (/ (- (System/nanoTime) start) 1e9)))
+
+(defn measure!
+  "Times f on the source, after a warm up run, and prints the throughput of
+   each run, in MB/s."
+  [name source runs f]
+  (f source)
+  (let [megabytes (/ (count source) 1e6)
+        rates (sort (repeatedly runs #(/ megabytes (seconds (fn [] (f source))))))]
+    (println (format (str "{\"suite\": \"parse\", \"name\": \"%s\", \"unit\": \"MB/s\", "
+                          "\"megabytes\": %.2f, \"median\": %.2f, \"min\": %.2f, "
+                          "\"max\": %.2f, \"runs\": %d}")
+                     name
+                     megabytes
+                     (nth rates (quot runs 2))
+                     (first rates)
+                     (last rates)
+                     runs))
+    (flush)))
+
+(defn parse-source [source]
+  (binding [parse.binding/*input-file* "benchmark"
+            parse.binding/*input-source* source]
+    (parse/parse [])))
+
+(defn -main [& [megabytes runs]]
+  (let [size (long (* 1e6 (Double/parseDouble (or megabytes "4"))))
+        runs (Long/parseLong (or runs "5"))
+        source (generate-source size)
+        ; The grammar is much slower, so it's only given a sample.
+        sample (generate-source (min size 250000))]
+    (measure! "read" source runs parse.reader/read-source)
+    (measure! "read and transform" source runs parse-source)
+    (measure! "instaparse sample" sample runs
+              #(insta/add-line-and-column-info-to-metadata % (parse/parser %)))))
@@ -0,0 +1,136 @@
+(ns com.jeaye.jank.cache
+  (:require [clojure.edn :as edn]
+            [clojure.java.io :as io]
+            [clojure.string]))
+
+; Compiler output is cached on disk, addressed by a digest of everything
+; which went into it: the input, and the source of the compiler itself, so
+; changing either is just a miss. Entries are never invalidated. Caching is
+; best effort; anything which goes wrong with it is also just a miss.
+
+(defn directory
+  "Where the cache lives: JANK_CACHE_DIR, if it's set, or jank within the
+   user's cache directory."
+  []
+  (let [env (System/getenv)]
+    (cond
+      (get env "JANK_CACHE_DIR") (io/file (get env "JANK_CACHE_DIR"))
+      (get env "XDG_CACHE_HOME") (io/file (get env "XDG_CACHE_HOME") "jank")
+      :else (io/file (System/getProperty "user.home") ".cache" "jank"))))
+
+(defn digest
+  "A hex SHA-256 of the parts, each of which is turned into a string. Each
+   is prefixed by its length, so that moving text from one part to the next
+   changes the digest."
+  [parts]
+  (let [md (java.security.MessageDigest/getInstance "SHA-256")]
+    (doseq [part parts]
+      (let [bytes (.getBytes (str part) "UTF-8")]
+        (.update md (.getBytes (str (count bytes) ":") "UTF-8"))
+        (.update md bytes)))
+    (apply str (map #(format "%02x" %) (.digest md)))))
+
+(defn namespace-resources
+  "The source files of the loaded namespaces which start with the prefix."
+  [prefix]
+  (->> (all-ns)
+       (map (comp str ns-name))
+       (filter #(clojure.string/starts-with? % prefix))
+       sort
+       (map #(str (-> %
+                      (clojure.string/replace "-" "_")
+                      (clojure.string/replace "." "/"))
+                  ".clj"))))
+
+(defn fingerprint
+  "A digest of the resources, or nil if any of them can't be found, as when
+   running from a jar without sources, since then nothing can be safely
+   cached."
+  [resources]
+  (let [contents (map #(some-> (io/resource %) slurp) resources)]
+    (when (every? some? contents)
+      (digest (interleave resources contents)))))
+
+(defn edn-str
+  "The value as EDN, in full, so that equal values always print the same."
+  [value]
+  (binding [*print-length* nil
+            *print-level* nil
+            *print-meta* false
+            *print-namespace-maps* false]
+    (pr-str value)))
+
+(defn entry-file [kind key]
+  (io/file (directory) kind (str key ".edn")))
+
+(defn read-entry [file]
+  (try
+    (when (.exists file)
+      (edn/read-string (slurp file)))
+    (catch Exception _
+      nil)))
+
+(defn write-entry!
+  "Writes to a temporary file first, and then moves it into place, so that
+   concurrent builds never read half of an entry."
+  [file value]
+  (try
+    (let [dir (doto (.getParentFile file) .mkdirs)
+          tmp (java.io.File/createTempFile "entry" ".tmp" dir)]
+      (try
+        (spit tmp (edn-str value))
+        (java.nio.file.Files/move (.toPath tmp)
+                                  (.toPath file)
+                                  (into-array java.nio.file.CopyOption
+                                              [java.nio.file.StandardCopyOption/ATOMIC_MOVE
+                                               java.nio.file.StandardCopyOption/REPLACE_EXISTING]))
+        (finally
+          (.delete tmp))))
+    (catch Exception _
+      nil)))
+
+(defn lookup
+  "Returns the value cached under the kind and key, or calls compute and
+   caches what it returns. A nil key, from a missing fingerprint, means
+   there's no caching at all. Values need to be readable as EDN, and nil
+   values aren't cached."
+  [kind key compute]
+  (if (nil? key)
+    (compute)
+    (let [file (entry-file kind key)]
+      (if-some [value (read-entry file)]
+        value
+        (let [value (compute)]
+          (when (some? value)
+            (write-entry! file value))
+          value)))))
+
+(defn map-delta
+  "What changed from the old map to the new one, as pairs of a path and the
+   new value there, so that only that needs to be cached. Nested maps which
+   only grew are compared key by key; anything else which changed is
+   replaced whole."
+  ([old new]
+   (map-delta [] old new))
+  ([path old new]
+   (cond
+     (identical? old new) []
+
+     (and (map? old) (map? new) (every? #(contains? new %) (keys old)))
+     (into []
+           (mapcat (fn [[k v]]
+                     (if (contains? old k)
+                       (map-delta (conj path k) (get old k) v)
+                       [[(conj path k) v]])))
+           new)
+
+     (= old new) []
+     :else [[path new]])))
+
+(defn apply-map-delta [m delta]
+  (reduce (fn [m [path value]]
+            (if (empty? path)
+              value
+              (assoc-in m path value)))
+          m
+          delta))
@@ -3,135 +3,1182 @@
             [orchestra.core :refer [defn-spec]]
             [com.jeaye.jank.log :refer [pprint]]
             [com.jeaye.jank.parse.spec :as parse.spec]
+            [com.jeaye.jank.parse.transform :as parse.transform]
+            [com.jeaye.jank.fold.core :as fold.core]
+            [com.jeaye.jank.inference.core :as inference.core]
             [com.jeaye.jank.codegen.sanitize :as codegen.sanitize]))
 
+(def ^:dynamic *direct-fns*
+  "Top-level fn defs which can be called directly, mapping each sanitized name
+   to its parameter count."
+  {})
+
+(def ^:dynamic *globals*
+  "Sanitized names of all top-level defs."
+  #{})
+
+(def ^:dynamic *locals*
+  "Atom of the locals in scope, mapping each sanitized name to its unboxed
+   type, or nil if it's an object. Each C++ block gets its own copy, so that
+   the bindings within it don't leak out."
+  nil)
+
+(def ^:dynamic *keywords*
+  "Atom of the namespace and name of each keyword, in order of use. Each
+   keyword is interned once, as a static."
+  nil)
+
+(def ^:dynamic *shapes*
+  "Atom of the lowered keys of each record shape, in order of use. Each shape
+   is defined once, as a static, and shared by all records which have it."
+  nil)
+
+(def ^:dynamic *constants*
+  "Atom of the code for each constant collection or string, in order of use.
+   Each is built once, as a static, since it never changes."
+  nil)
+
+(def ^:dynamic *movable*
+  "Atom of the locals which can be moved from on their last use. These are
+   the objects bound within the current fn body; parameters and captures are
+   only borrowed. Scoped like *locals*."
+  nil)
+
+(def ^:dynamic *later-uses*
+  "Names which may be read after the expression being lowered, within the
+   enclosing blocks."
+  #{})
+
+(def ^:dynamic *self*
+  "The fn whose body is being lowered, if it refers to itself: the sanitized
+   names it goes by, its parameter count, a fn for the code which calls it
+   with the given arguments, and the code for its value."
+  nil)
+
+(def ^:dynamic *definitions*
+  "Atom of the code for each fn which isn't a direct fn, in the order they're
+   lowered, so nested fns come before the fns which make them. Each has a
+   definition and, if it needs one, a declaration."
+  nil)
+
+(def ^:dynamic *get-caches*
+  "Atom of the code for the key of each get with a constant key, in order of
+   use. Each call site gets its own cache, as a static, even for the same key,
+   since each remembers the last record shape it saw."
+  nil)
+
+(def ^:dynamic *recur-target*
+  "What recur rebinds, in the innermost loop: the names to assign, in order,
+   along with the sanitized names of the bindings themselves."
+  nil)
+
+(def ^:dynamic *tmp-counter*
+  "Counter for naming the temporaries which hold the results of statements."
+  nil)
+
+(def nil-constant {::parse.spec/kind :constant
+                   ::parse.spec/type :nil})
+
+(defn binding-name [expression]
+  (-> expression ::parse.spec/identifier ::parse.spec/name))
+
+(defn direct-fn-name [ident]
+  (str "_gen_fn_" ident))
+
+(defn identifier->code [expression]
+  (codegen.sanitize/sanitize-str (::parse.spec/name expression)))
+
+(defn next-tmp! []
+  (str "_gen_tmp_" (swap! *tmp-counter* inc)))
+
+(defn in-scope
+  "Lowers statements, by calling f, within a new block scope."
+  [f]
+  (binding [*locals* (atom @*locals*)
+            *movable* (atom @*movable*)]
+    (vec (f))))
+
+(defn ast-nodes [expression]
+  (tree-seq coll?
+            #(if (map? %)
+               (vals %)
+               %)
+            expression))
+
+(defn identifier-names
+  "The sanitized names of all identifiers within the expression, including
+   within nested fns."
+  [expression]
+  (into #{}
+        (comp (filter #(and (map? %) (= :identifier (::parse.spec/kind %))))
+              (map identifier->code))
+        (ast-nodes expression)))
+
+(declare sequence-free-names)
+
+(defn free-names
+  "The sanitized names of the identifiers which the expression reads from
+   outside of itself, given the names which are already bound. Unlike
+   identifier-names, this knows where each binding is in scope."
+  [expression bound]
+  (let [all-free-names (fn [expressions]
+                         (into #{} (mapcat #(free-names % bound)) expressions))]
+    (case (::parse.spec/kind expression)
+      :identifier (let [ident (identifier->code expression)]
+                    (if (or (some? (::parse.spec/ns expression))
+                            (contains? bound ident))
+                      #{}
+                      #{ident}))
+      :constant (all-free-names (fold.core/literal-children expression))
+      :application (all-free-names (cons (::parse.spec/value expression)
+                                         (::parse.spec/arguments expression)))
+      :recur (all-free-names (::parse.spec/arguments expression))
+      :if (all-free-names (keep expression [::parse.spec/condition
+                                            ::parse.spec/then
+                                            ::parse.spec/else]))
+      (:let :loop) (sequence-free-names (conj (vec (::parse.spec/bindings expression))
+                                              (::parse.spec/body expression))
+                                        bound)
+      :do (sequence-free-names (conj (vec (::parse.spec/body expression))
+                                     (::parse.spec/return expression))
+                               bound)
+      ; Bindings aren't in scope within their own initializers, unless it's a
+      ; fn, which can call itself by the name it's bound to.
+      :binding (free-names (::parse.spec/value expression)
+                           (cond-> bound
+                             (= :fn (-> expression ::parse.spec/value ::parse.spec/kind))
+                             (conj (identifier->code (::parse.spec/identifier expression)))))
+      :fn (free-names (::parse.spec/body expression)
+                      (into bound
+                            (map (comp identifier->code ::parse.spec/identifier))
+                            (cond-> (vec (::parse.spec/parameters expression))
+                              (contains? expression ::parse.spec/name)
+                              (conj (::parse.spec/name expression)))))
+      #{})))
+
+(defn sequence-free-names
+  "Like free-names, for expressions in sequence, where each binding is in
+   scope for everything after it."
+  [expressions bound]
+  (first (reduce (fn [[free bound] expression]
+                   [(into free (free-names expression bound))
+                    (cond-> bound
+                      (= :binding (::parse.spec/kind expression))
+                      (conj (identifier->code (::parse.spec/identifier expression))))])
+                 [#{} bound]
+                 expressions)))
+
+(defn movable?
+  "Whether the local is an object which won't be read again, so its value can
+   be moved out."
+  [ident]
+  (and (contains? @*movable* ident)
+       (not (contains? *later-uses* ident))))
+
+(defn last-use?
+  "Whether the identifier is a local object which won't be read again."
+  [expression]
+  (and (nil? (::parse.spec/ns expression))
+       (movable? (identifier->code expression))))
+
+(defn self-name?
+  "Whether the identifier refers to the fn whose body is being lowered, by one
+   of the names it goes by. Locals shadow those."
+  [expression]
+  (let [ident (identifier->code expression)]
+    (and (nil? (::parse.spec/ns expression))
+         (contains? (::names *self*) ident)
+         (not (contains? @*locals* ident)))))
+
+(defn suffix-unions
+  "For each element, the union of f applied to it and everything after it."
+  [f xs]
+  (->> (reverse xs)
+       (reductions #(into %1 (f %2)) #{})
+       rest
+       reverse
+       vec))
+
+(defn parameter-scope
+  "The locals within a fn body. Parameters can be passed anything, so they're
+   always objects."
+  [locals parameters]
+  (reduce #(assoc %1 (-> %2 ::parse.spec/identifier identifier->code) nil)
+          locals
+          parameters))
+
+(def unboxed-types
+  "C++ types for values which can be unboxed, along with the object aliases
+   used to box them again."
+  {:integer {::type "detail::integer"
+             ::box "JANK_INTEGER"}
+   :real {::type "detail::real"
+          ::box "JANK_REAL"}
+   :boolean {::type "detail::boolean"
+             ::box "JANK_BOOL"}})
+
+(defn promoted-type [arg-types]
+  (if (some #{:real} arg-types)
+    :real
+    :integer))
+
+(def unboxed-fns
+  "Prelude fns with C++ equivalents on unboxed numbers, by sanitized name.
+   Each has a format string for its unboxed arguments and a fn to determine
+   its result type from theirs. These match what the prelude does, once it's
+   visited its arguments."
+  {"_gen_plus_" ["(%s + %s)" promoted-type]
+   "_gen_minus_" ["(%s - %s)" promoted-type]
+   "_gen_asterisk_" ["(%s * %s)" promoted-type]
+   "div" ["(%s / %s)" promoted-type]
+   "_gen_less_" ["(%s < %s)" (constantly :boolean)]
+   "_gen_less__gen_equal_" ["(%s <= %s)" (constantly :boolean)]
+   "inc" ["(%s + 1)" first]
+   "dec" ["(%s - 1)" first]
+   "sqrt" ["std::sqrt(%s)" (constantly :real)]
+   "tan" ["std::tan(%s)" (constantly :real)]
+   "pow" ["std::pow(%s, %s)" (constantly :real)]
+   "_gen_minus__gen_greater_int" ["static_cast<detail::integer>(%s)" (constantly :integer)]
+   "_gen_minus__gen_greater_float" ["static_cast<detail::real>(%s)" (constantly :real)]})
+
+(defn inferred-type
+  "The inferred type of an expression, if it was resolved to a single type."
+  [expression]
+  (let [typ (::inference.core/type expression)]
+    (when (= ::inference.core/single (::inference.core/type-kind typ))
+      (keyword (::inference.core/name typ)))))
+
+(defn prelude-callee
+  "The sanitized name of the prelude fn being applied, if any. Both locals and
+   top-level defs shadow prelude fns."
+  [expression]
+  (let [callee (::parse.spec/value expression)]
+    (when (and (= :identifier (::parse.spec/kind callee))
+               (nil? (::parse.spec/ns callee)))
+      (let [fn-name (identifier->code callee)]
+        (when-not (or (contains? @*locals* fn-name)
+                      (contains? *globals* fn-name)
+                      (contains? (::names *self*) fn-name))
+          fn-name)))))
+
+(defn unboxed-type
+  "The type of the expression's value, if it can be computed without any
+   objects. Inferred types aren't enough on their own, since they can be
+   constrained by how values are used, rather than how they're made; a fn
+   parameter may be passed anything. So all inputs need to be unboxed as well,
+   and inference needs to agree with the result."
+  [expression]
+  (let [typ (case (::parse.spec/kind expression)
+              :constant (#{:integer :real} (::parse.spec/type expression))
+              :identifier (get @*locals* (identifier->code expression))
+              :application (when-some [[template result-type] (unboxed-fns (prelude-callee expression))]
+                             (let [arg-types (map unboxed-type (::parse.spec/arguments expression))]
+                               (when (and (= (count arg-types) (count (re-seq #"%s" template)))
+                                          (every? #{:integer :real} arg-types))
+                                 (result-type arg-types))))
+              nil)]
+    (when (and (some? typ)
+               (= typ (inferred-type expression)))
+      typ)))
+
+(defn box [typ value]
+  (str (-> typ unboxed-types ::box) "(" value ")"))
+
+(def shape-key-types #{:nil :boolean :integer :real :string :keyword})
+
+(defn record-keys
+  "Map literals with distinct, constant keys become records. Returns their
+   keys, if so."
+  [expression]
+  (let [ks (map ::parse.spec/key (::parse.spec/values expression))]
+    (when (and (not-empty ks)
+               (every? #(and (= :constant (::parse.spec/kind %))
+                             (contains? shape-key-types (::parse.spec/type %)))
+                       ks)
+               (apply distinct? (map (juxt ::parse.spec/type
+                                           ::parse.spec/value
+                                           ::parse.spec/ns
+                                           ::parse.spec/name)
+                                     ks)))
+      ks)))
+
+(defn static-index!
+  "Finds the index of the value within the statics, adding it if needed."
+  [statics value]
+  (let [values (swap! statics #(if (some #{value} %)
+                                 %
+                                 (conj % value)))]
+    (.indexOf values value)))
+
+(defn shape-name! [key-values]
+  (str "_gen_shape_" (static-index! *shapes* key-values)))
+
+(def current-ns
+  "There are no namespaces yet, so auto-resolved keywords belong to user, as
+   they would in a Clojure REPL."
+  "user")
+
+(defn keyword-name! [expression]
+  (let [ns (::parse.spec/ns expression)]
+    (str "_gen_keyword_" (static-index! *keywords*
+                                        [(cond
+                                           (= ::parse.spec/current ns) current-ns
+                                           (nil? ns) ""
+                                           :else ns)
+                                         (::parse.spec/name expression)]))))
+
+; Statics are defined once, in the main unit, and declared in the header, so
+; that every unit shares them.
+(defn keyword-declaration [index _]
+  (str "extern object const _gen_keyword_" index ";\n"))
+
+(defn keyword-definition [index [ns keyword-name]]
+  (let [escape #(clojure.string/escape % {\\ "\\\\"})]
+    (str "object const _gen_keyword_" index
+         "{ JANK_KEYWORD(\"" (escape ns) "\", \"" (escape keyword-name) "\") };\n")))
+
+(defn constant-declaration [index _]
+  (str "extern object const _gen_constant_" index ";\n"))
+
+(defn constant-definition [index value]
+  (str "object const _gen_constant_" index "{ " value " };\n"))
+
+(defn get-cache-declaration [index _]
+  (str "extern detail::get_cache _gen_get_cache_" index ";\n"))
+
+(defn get-cache-definition [index key-value]
+  (str "detail::get_cache _gen_get_cache_" index "{ " key-value " };\n"))
+
+(defn shape-declaration [index _]
+  (str "extern detail::shape const _gen_shape_" index ";\n"))
+
+(defn shape-definition [index key-values]
+  (str "detail::shape const _gen_shape_" index "{ "
+       (clojure.string/join ", " key-values)
+       " };\n"))
+
+; Expressions are lowered into a C++ expression for their value, along with the
+; statements which need to run before that expression can be evaluated. Most
+; expressions don't need any statements; control flow, like if, let, and do,
+; is what introduces them.
+(defn lowered
+  ([value]
+   (lowered [] value))
+  ([statements value]
+   {::statements statements
+    ::value value}))
+
 (defmulti expression->code
+  "Lowers an expression into its value and the statements it needs."
   (fn [expression]
     (::parse.spec/kind expression)))
 
+(defmulti expression->statements
+  "Lowers an expression into statements which deliver its value to the
+   destination. The destination is either :return, :discard, or the name of
+   a temporary to assign."
+  (fn [expression destination]
+    (::parse.spec/kind expression)))
+
+(defn trivial? [value]
+  (re-matches #"[\w:]+" value))
+
+(defn destination->code [destination value]
+  (case destination
+    :return (str "return " value ";")
+    :discard (when-not (trivial? value)
+               (str value ";"))
+    (str destination " = " value ";")))
+
+(defn block [statements]
+  (str "{\n" (clojure.string/join "\n" (remove nil? statements)) "\n}"))
+
+(defn lower-to-tmp
+  "Lowers a statement-oriented expression by having it assign its value to a
+   new temporary. The temporary is only read once, so it can be moved from."
+  [expression]
+  (let [tmp (next-tmp!)]
+    (lowered (into [(str "JANK_OBJECT " tmp ";")]
+                   (expression->statements expression tmp))
+             (str "std::move(" tmp ")"))))
+
+(defn later-uses
+  "Lowers, by calling f, knowing the names will be read afterward."
+  [names f]
+  (binding [*later-uses* (into *later-uses* names)]
+    (f)))
+
+(defn other-names
+  "The union of all of the sets of names, other than the one at index i."
+  [names i]
+  (into #{} cat (concat (subvec names 0 i) (subvec names (inc i)))))
+
+(defn lower-all
+  "Lowers each expression, gathering all statements in order. The values are
+   only read once all of the statements have run, so each expression's
+   statements come before reads of every other expression's names."
+  [expressions]
+  (let [names (mapv identifier-names expressions)]
+    (reduce (fn [acc [i expression]]
+              (let [{::keys [statements value]} (later-uses (other-names names i)
+                                                            #(expression->code expression))]
+                (-> (update acc ::statements into statements)
+                    (update ::values conj value))))
+            {::statements []
+             ::values []}
+            (map-indexed vector expressions))))
+
+(defn number->code
+  "The C++ literal for a number. The most negative integer needs spelling out,
+   since C++ reads -9223372036854775808 as the negation of a literal which is
+   out of range."
+  [value]
+  (if (= Long/MIN_VALUE value)
+    "(-9223372036854775807 - 1)"
+    (str value)))
+
+(defn expression->unboxed
+  "Lowers an expression which has an `unboxed-type` into a C++ value of that
+   type."
+  [expression]
+  (case (::parse.spec/kind expression)
+    :constant (lowered (str (-> expression ::parse.spec/type unboxed-types ::type)
+                            "(" (number->code (::parse.spec/value expression)) ")"))
+    :identifier (lowered (identifier->code expression))
+    :application (let [[template _] (unboxed-fns (prelude-callee expression))
+                       args (map expression->unboxed (::parse.spec/arguments expression))]
+                   (lowered (into [] (mapcat ::statements) args)
+                            (apply format template (map ::value args))))))
+
+(defmethod expression->statements :default
+  [expression destination]
+  (let [{::keys [statements value]} (expression->code expression)]
+    (conj statements (destination->code destination value))))
+
+(def hoisted-types
+  "Constant types which need allocating. Literals of these which are made only
+   of other literals never change, so they're hoisted into statics."
+  #{:string :vector :set :map})
+
+(declare literal->code)
+
 (defmethod expression->code :constant
   [expression]
+  (let [code (literal->code expression)]
+    (if (and (contains? hoisted-types (::parse.spec/type expression))
+             (fold.core/literal? expression))
+      (lowered (str "_gen_constant_" (static-index! *constants* (::value code))))
+      code)))
+
+(defn literal->code [expression]
   (case (::parse.spec/type expression)
-    :nil "JANK_NIL"
-    :boolean (if (::parse.spec/value expression)
-               "JANK_TRUE"
-               "JANK_FALSE")
-    :integer (str "JANK_INTEGER(" (::parse.spec/value expression) ")")
-    :real (str "JANK_REAL(" (::parse.spec/value expression) ")")
+    :nil (lowered "JANK_NIL")
+    :boolean (lowered (if (::parse.spec/value expression)
+                        "JANK_TRUE"
+                        "JANK_FALSE"))
+    :integer (lowered (str "JANK_INTEGER(" (number->code (::parse.spec/value expression)) ")"))
+    :real (lowered (str "JANK_REAL(" (number->code (::parse.spec/value expression)) ")"))
     ; TODO: Escape quotes.
-    :string (str "JANK_STRING(\"" (::parse.spec/value expression) "\")")
+    :string (lowered (str "JANK_STRING(\"" (::parse.spec/value expression) "\")"))
+    :keyword (lowered (keyword-name! expression))
     ; TODO: Raw string?
-    :regex (str "JANK_REGEX(\"" (::parse.spec/value expression) "\")")
-    :map (str "JANK_MAP("
-              (->> (mapcat vals (::parse.spec/values expression))
-                   (map expression->code)
-                   (partition 2)
-                   (map (fn [[k v]]
-                          (str "JANK_MAP_ENTRY(" k ", " v ")")))
-                   (clojure.string/join ", ")
-                   (apply str))
-              ")")
-    :vector (str "JANK_VECTOR("
-                 (->> (map expression->code (::parse.spec/values expression))
-                      (clojure.string/join ", ")
-                      (apply str))
-                 ")")
-    :set (str "JANK_SET("
-              (->> (map expression->code (::parse.spec/values expression))
-                   (clojure.string/join ", ")
-                   (apply str))
-              ")")
-    ))
+    :regex (lowered (str "JANK_REGEX(\"" (::parse.spec/value expression) "\")"))
+    :map (if-some [ks (record-keys expression)]
+           ; Shapes are already statics, so their keys aren't hoisted.
+           (let [shape (shape-name! (mapv (comp ::value literal->code) ks))
+                 {::keys [statements values]} (lower-all (map ::parse.spec/value
+                                                              (::parse.spec/values expression)))]
+             (lowered statements
+                      (str "JANK_RECORD("
+                           (clojure.string/join ", " (cons shape values))
+                           ")")))
+           (let [{::keys [statements values]} (lower-all (mapcat vals (::parse.spec/values expression)))]
+             (lowered statements
+                      (str "JANK_MAP("
+                           (->> (partition 2 values)
+                                (map (fn [[k v]]
+                                       (str "JANK_MAP_ENTRY(" k ", " v ")")))
+                                (clojure.string/join ", "))
+                           ")"))))
+    :vector (let [{::keys [statements values]} (lower-all (::parse.spec/values expression))]
+              (lowered statements
+                       (str "JANK_VECTOR(" (clojure.string/join ", " values) ")")))
+    :set (let [{::keys [statements values]} (lower-all (::parse.spec/values expression))]
+           (lowered statements
+                    (str "JANK_SET(" (clojure.string/join ", " values) ")")))))
+
+; Only whole values are moved from, where the identifier is all that's being
+; assigned, so nothing else in the same C++ expression can read it afterward.
+(defmethod expression->statements :identifier
+  [expression destination]
+  (let [{::keys [statements value]} (expression->code expression)]
+    (conj statements
+          (destination->code destination
+                             (if (and (string? destination) (last-use? expression))
+                               (str "std::move(" value ")")
+                               value)))))
 
 (defmethod expression->code :identifier
   [expression]
-  (codegen.sanitize/sanitize-str (::parse.spec/name expression)))
+  (let [ident (identifier->code expression)]
+    (if-some [typ (unboxed-type expression)]
+      (lowered (box typ ident))
+      (lowered (if (self-name? expression)
+                 (::value *self*)
+                 ident)))))
+
+(declare fn->code)
+
+(defn object-binding->statements
+  "Lowers a binding into an object. The binding isn't in scope within its own
+   initializer, so initializers which read the same name go through a
+   temporary. A fn can still call itself by the name it's bound to, since
+   that doesn't read the binding."
+  [expression]
+  (let [ident (identifier->code (::parse.spec/identifier expression))
+        value-expression (::parse.spec/value expression)
+        self-reference? (contains? (free-names expression #{}) ident)
+        moved? (and (= :identifier (::parse.spec/kind value-expression))
+                    (not self-reference?)
+                    (last-use? value-expression))
+        {::keys [statements value]} (cond
+                                      self-reference? (lower-to-tmp value-expression)
+                                      (= :fn (::parse.spec/kind value-expression))
+                                      (fn->code value-expression (binding-name expression))
+                                      :else (expression->code value-expression))]
+    (swap! *locals* assoc ident nil)
+    ; Fns capture values, rather than locals, so every object can be moved
+    ; from on its last use.
+    (swap! *movable* conj ident)
+    (conj statements (str "JANK_OBJECT " ident "{ "
+                          (if moved?
+                            (str "std::move(" value ")")
+                            value)
+                          " };"))))
+
+(defmethod expression->statements :binding
+  [expression destination]
+  (let [ident (identifier->code (::parse.spec/identifier expression))
+        value-expression (::parse.spec/value expression)]
+    (if-some [typ (unboxed-type value-expression)]
+      (let [{::keys [statements value]} (expression->unboxed value-expression)
+            cpp-type (-> typ unboxed-types ::type)
+            tmp (when (contains? (identifier-names value-expression) ident)
+                  (next-tmp!))]
+        (swap! *locals* assoc ident typ)
+        (swap! *movable* disj ident)
+        (cond-> (if (some? tmp)
+                  (conj statements
+                        (str cpp-type " " tmp "{ " value " };")
+                        (str cpp-type " " ident "{ " tmp " };"))
+                  (conj statements (str cpp-type " " ident "{ " value " };")))
+          (not= :discard destination)
+          (conj (destination->code destination (box typ ident)))))
+      (-> (object-binding->statements expression)
+          (conj (destination->code destination ident))))))
 
 (defmethod expression->code :binding
   [expression]
-  (let [ident (expression->code (::parse.spec/identifier expression))]
-    ; Allow recursion by having the fn capture its own object.
-    (str "JANK_OBJECT "
-         ident
-         ";"
-         ident
-         " = "
-         (expression->code (::parse.spec/value expression))
-         ";")))
+  (lower-to-tmp expression))
+
+(defn sequence->statements
+  "Lowers expressions in order, discarding all values but the last, which is
+   delivered to the destination. Each expression knows which names are read
+   after it, so locals can be moved from on their last use."
+  [expressions destination]
+  (let [expressions (vec expressions)
+        read-after (conj (subvec (suffix-unions identifier-names expressions) 1) #{})]
+    (into []
+          (mapcat (fn [i]
+                    (binding [*later-uses* (into *later-uses* (read-after i))]
+                      (expression->statements (expressions i)
+                                              (if (= i (dec (count expressions)))
+                                                destination
+                                                :discard)))))
+          (range (count expressions)))))
+
+; Lets and dos are blocks, so their bindings don't leak into the enclosing
+; scope. Destinations are never bindings, so they can't be shadowed within.
+(defmethod expression->statements :let
+  [expression destination]
+  [(block (in-scope #(sequence->statements (conj (vec (::parse.spec/bindings expression))
+                                                 (::parse.spec/body expression))
+                                           destination)))])
 
 (defmethod expression->code :let
   [expression]
-  (let [bindings (mapv expression->code (::parse.spec/bindings expression))
-        body (expression->code (::parse.spec/body expression))
-        return (expression->code (::parse.spec/return expression))]
-    (str "[&](){\n"
-         (clojure.string/join "\n" bindings)
-         body ";\n"
-         "return " return ";"
-         "\n}()")))
+  (lower-to-tmp expression))
+
+(defmethod expression->statements :do
+  [expression destination]
+  [(block (in-scope #(sequence->statements (conj (vec (::parse.spec/body expression))
+                                                 (::parse.spec/return expression))
+                                           destination)))])
 
 (defmethod expression->code :do
   [expression]
-  (let [body (mapv expression->code (::parse.spec/body expression))
-        return (expression->code (::parse.spec/return expression))]
-    (str "[&](){\n"
-         (clojure.string/join ";\n" body) ";\n"
-         "return " return ";"
-         "\n}()")))
+  (lower-to-tmp expression))
+
+(defmethod expression->statements :if
+  [expression destination]
+  (let [condition (::parse.spec/condition expression)
+        ; Unboxed conditions are already booleans.
+        unboxed? (= :boolean (unboxed-type condition))
+        branch-names (into (identifier-names (::parse.spec/then expression))
+                           (identifier-names (::parse.spec/else expression)))
+        {::keys [statements value]} (later-uses branch-names
+                                                #(if unboxed?
+                                                   (expression->unboxed condition)
+                                                   (expression->code condition)))
+        then (in-scope #(expression->statements (::parse.spec/then expression) destination))
+        else (in-scope #(expression->statements (or (::parse.spec/else expression) nil-constant)
+                                                destination))]
+    (conj statements
+          (str (if unboxed?
+                 (str "if(" value ")\n")
+                 (str "if(detail::truthy(" value "))\n"))
+               (block then)
+               "\nelse\n"
+               (block else)))))
 
 (defmethod expression->code :if
   [expression]
-  (let [condition (expression->code (::parse.spec/condition expression))
-        then (expression->code (::parse.spec/then expression))
-        else (expression->code (::parse.spec/else expression))]
-    (str "[&](){\nif(detail::truthy("
-         condition
-         "))\n{\n"
-         "return " then ";"
-         "\n}\n"
-         "else\n{\n"
-         "return " else ";"
-         "\n}\n}()")))
+  (lower-to-tmp expression))
+
+(declare local-binding-names)
+
+; Loops run their body until it delivers a value. Every recur is in tail
+; position, so it only needs to rebind and start the next iteration; every
+; other path falls through to the end of the body, which breaks out.
+(defmethod expression->statements :loop
+  [expression destination]
+  (let [bindings (vec (::parse.spec/bindings expression))
+        body (::parse.spec/body expression)
+        idents (mapv (comp identifier->code ::parse.spec/identifier) bindings)
+        shadowed (into #{}
+                       (map codegen.sanitize/sanitize-str)
+                       (local-binding-names [body]))
+        read-after (suffix-unions identifier-names (conj bindings body))]
+    [(block
+       (in-scope
+         (fn []
+           (let [initial (into []
+                               (mapcat (fn [i]
+                                         (binding [*later-uses* (into *later-uses* (read-after (inc i)))]
+                                           (object-binding->statements (bindings i)))))
+                               (range (count bindings)))
+                 ; Bindings which the body shadows are rebound through a
+                 ; reference, since their names may mean something else
+                 ; where recur is.
+                 targets (mapv #(if (contains? shadowed %)
+                                  (next-tmp!)
+                                  %)
+                               idents)
+                 references (keep (fn [[ident target]]
+                                    (when (not= ident target)
+                                      (str "JANK_OBJECT &" target "{ " ident " };")))
+                                  (map vector idents targets))
+                 ; Everything else the body reads is read again by the next
+                 ; iteration. The bindings are rebound before then.
+                 body-statements (binding [*later-uses* (into *later-uses*
+                                                              (apply disj (identifier-names body) idents))
+                                           *recur-target* {::targets targets
+                                                           ::idents idents}]
+                                   (expression->statements body destination))]
+             (-> initial
+                 (into references)
+                 (conj (str "while(true)\n"
+                            (block (cond-> body-statements
+                                     (not= :return destination)
+                                     (conj "break;"))))))))))]))
+
+(defmethod expression->code :loop
+  [expression]
+  (lower-to-tmp expression))
+
+; All arguments are evaluated before anything is rebound, so arguments which
+; read a binding that's rebound before them are held in temporaries.
+(defmethod expression->statements :recur
+  [expression _]
+  (let [{::keys [targets idents]} *recur-target*
+        arguments (vec (::parse.spec/arguments expression))
+        names (mapv identifier-names arguments)
+        {::keys [statements values]} (lower-all arguments)
+        rebinds (map-indexed (fn [i value]
+                               (let [argument (arguments i)
+                                     moved? (and (= :identifier (::parse.spec/kind argument))
+                                                 (later-uses (other-names names i)
+                                                             #(last-use? argument)))]
+                                 {::target (targets i)
+                                  ::value (if moved?
+                                            (str "std::move(" value ")")
+                                            value)
+                                  ::held? (some (set (subvec idents 0 i)) (names i))}))
+                             values)
+        held (into {}
+                   (comp (filter ::held?)
+                         (map (juxt ::target (fn [_] (next-tmp!)))))
+                   rebinds)]
+    (-> statements
+        (into (map #(str "JANK_OBJECT " (held (::target %)) "{ " (::value %) " };")
+                   (filter ::held? rebinds)))
+        (into (keep #(cond
+                       (::held? %) (str (::target %) " = std::move(" (held (::target %)) ");")
+                       ; Passing a binding along as it is doesn't rebind it.
+                       (not= (::target %) (::value %)) (str (::target %) " = " (::value %) ";"))
+                    rebinds))
+        (conj "continue;"))))
+
+(defn parameters->code [parameters]
+  (->> parameters
+       (map (fn [param]
+              (str "JANK_OBJECT const &" (-> param ::parse.spec/identifier identifier->code))))
+       (clojure.string/join ", ")))
+
+(defn tail-calls->recur
+  "Replaces calls to the fn by any of its sanitized self names, with the given
+   parameter count, which are in tail position with recurs."
+  [expression self-names arity]
+  (case (::parse.spec/kind expression)
+    :application (let [callee (::parse.spec/value expression)]
+                   (if (and (= :identifier (::parse.spec/kind callee))
+                            (nil? (::parse.spec/ns callee))
+                            (contains? self-names (identifier->code callee))
+                            (= arity (count (::parse.spec/arguments expression))))
+                     {::parse.spec/kind :recur
+                      ::parse.spec/arguments (::parse.spec/arguments expression)}
+                     expression))
+    :do (update expression ::parse.spec/return tail-calls->recur self-names arity)
+    :let (update expression ::parse.spec/body tail-calls->recur self-names arity)
+    :if (cond-> (update expression ::parse.spec/then tail-calls->recur self-names arity)
+          (contains? expression ::parse.spec/else)
+          (update ::parse.spec/else tail-calls->recur self-names arity))
+    expression))
+
+(defn fn-body
+  "The fn's body, with its self calls in tail position turned into recurs.
+   A body which recurs becomes a loop over the parameters, so recursing
+   doesn't grow the stack."
+  [expression self-names]
+  (let [parameters (::parse.spec/parameters expression)
+        body (tail-calls->recur (::parse.spec/body expression) self-names (count parameters))]
+    (if (empty? (parse.transform/target-recurs body))
+      body
+      {::parse.spec/kind :do
+       ::parse.spec/body []
+       ::parse.spec/return {::parse.spec/kind :loop
+                            ::parse.spec/bindings (mapv #(assoc %
+                                                                ::parse.spec/value (::parse.spec/identifier %)
+                                                                ::parse.spec/scope ::parse.spec/loop)
+                                                        parameters)
+                            ::parse.spec/body body}})))
+
+(defn fn-body->statements
+  "Lowers the fn's body, given the locals it reads from outside of itself.
+   The self names are what the body can call the fn by."
+  [expression self-names locals]
+  ; Parameters are references, and captures belong to the fn, so neither can
+  ; be moved from.
+  (binding [*locals* (atom (parameter-scope locals (::parse.spec/parameters expression)))
+            *movable* (atom #{})
+            *recur-target* nil]
+    (vec (expression->statements (fn-body expression self-names) :return))))
+
+(defn fn-self-names
+  "The sanitized names a fn expression calls itself by within its body: the
+   name it was given and the name of the binding it's the value of, if any.
+   Names which are shadowed anywhere within it are left out."
+  [expression bound-name]
+  (let [body (::parse.spec/body expression)
+        shadowed (into (set (map binding-name (::parse.spec/parameters expression)))
+                       (local-binding-names [body]))
+        read (free-names body #{})]
+    (into #{}
+          (comp (remove nil?)
+                (remove shadowed)
+                (map codegen.sanitize/sanitize-str)
+                (filter read))
+          [(some-> expression ::parse.spec/name binding-name) bound-name])))
+
+(defn capture-type [typ]
+  (if (some? typ)
+    (-> typ unboxed-types ::type)
+    "JANK_OBJECT"))
+
+; Fns capture the values of the locals they read when they're made, so they
+; can outlive the scope they were made in. Fns which capture nothing become
+; plain functions, with one constant function object for all of their uses.
+; Everything else becomes a closure struct with exactly its captures as
+; members, copied, or moved on their last use, into a new function object.
+(defn fn->code
+  "Lowers a fn into a function object. The bound name is the name of the
+   binding the fn is the value of, if any, which it can call itself by."
+  [expression bound-name]
+  (let [parameters (::parse.spec/parameters expression)
+        arity (count parameters)
+        self-names (fn-self-names expression bound-name)
+        ; An enclosing fn's self names aren't locals, but they're captured
+        ; just the same.
+        captures (->> (free-names expression #{})
+                      (remove self-names)
+                      (filter #(or (contains? @*locals* %)
+                                   (contains? (::names *self*) %)))
+                      sort
+                      vec)
+        index (swap! *tmp-counter* inc)]
+    (if (empty? captures)
+      (let [fn-name (str "_gen_lambda_" index)
+            signature (str "JANK_OBJECT " fn-name "(" (parameters->code parameters) ")")
+            constant (str "_gen_constant_" (static-index! *constants*
+                                                          (str "detail::function{ &" fn-name " }")))
+            body (binding [*self* {::names self-names
+                                   ::arity arity
+                                   ::call #(str fn-name "(" (clojure.string/join ", " %) ")")
+                                   ::value constant}]
+                   (fn-body->statements expression self-names {}))]
+        (swap! *definitions* conj {::declaration (str signature ";\n")
+                                   ::definition (str signature "\n" (block body) "\n")})
+        (lowered constant))
+      (let [struct-name (str "_gen_closure_" index)
+            types (mapv #(get @*locals* %) captures)
+            values (mapv #(cond
+                            (not (contains? @*locals* %)) (::value *self*)
+                            (movable? %) (str "std::move(" % ")")
+                            :else %)
+                         captures)
+            ; Closures which call themselves are passed their own function,
+            ; since they can't get to it otherwise.
+            self-parameter (when (not-empty self-names)
+                             "detail::function const &_gen_self")
+            body (binding [*self* {::names self-names
+                                   ::arity arity
+                                   ::call #(str "(*this)("
+                                                (clojure.string/join ", " (cons "_gen_self" %))
+                                                ")")
+                                   ::value "JANK_OBJECT{ _gen_self }"}]
+                   (fn-body->statements expression self-names (zipmap captures types)))]
+        (swap! *definitions* conj {::definition (str "struct " struct-name "\n{\n"
+                                                     (apply str (map #(str (capture-type %1) " " %2 ";\n")
+                                                                     types
+                                                                     captures))
+                                                     "JANK_OBJECT operator()("
+                                                     (->> [self-parameter (parameters->code parameters)]
+                                                          (remove empty?)
+                                                          (clojure.string/join ", "))
+                                                     ") const\n"
+                                                     (block body)
+                                                     "\n};\n")})
+        (lowered (str "detail::function{ " struct-name "{ "
+                      (clojure.string/join ", " values)
+                      " } }"))))))
 
 (defmethod expression->code :fn
   [expression]
-  (let [fn-type (str "JANK_OBJECT ("
-                     (->> (repeat (-> expression ::parse.spec/parameters count) "JANK_OBJECT const &")
-                          (clojure.string/join ", "))
-                     ")")
-        params (mapv (fn [param]
-                       (str "JANK_OBJECT const &" (-> param ::parse.spec/identifier expression->code)))
-                     (::parse.spec/parameters expression))]
-    (str "std::function<" fn-type ">{"
-         "[&]("
-         (clojure.string/join ", " params)
-         ") -> JANK_OBJECT {\n"
-         "return " (expression->code (::parse.spec/body expression)) ";\n"
-         "}}\n")))
+  (fn->code expression nil))
+
+(def borrowing-fns
+  "Prelude fns with variants which return a reference into one of their
+   arguments, rather than a copy, by sanitized name, along with their
+   parameter count. Generated code only ever reads the reference within the
+   same full expression, or copies it into an object, so it never outlives
+   what it refers to."
+  {"get" [2 "detail::get_ref"]})
+
+(defn constant-key?
+  "Whether the expression is a constant which can be a key of a shape, so its
+   hash never changes."
+  [expression]
+  (and (= :constant (::parse.spec/kind expression))
+       (contains? shape-key-types (::parse.spec/type expression))))
+
+(defn get-cache-name! [key-value]
+  (let [index (count (swap! *get-caches* conj key-value))]
+    (str "_gen_get_cache_" (dec index))))
+
+(defn invocation->code [expression]
+  (let [callee (::parse.spec/value expression)
+        ; Self names refer to a value, rather than a local, so they're
+        ; treated like any other expression.
+        identifier? (and (= :identifier (::parse.spec/kind callee))
+                         (not (self-name? callee)))
+        arguments (::parse.spec/arguments expression)
+        lowered-callee (later-uses (into #{} (mapcat identifier-names) arguments)
+                                   #(expression->code callee))
+        ; Anything other than an identifier is evaluated into a local first,
+        ; since invoking needs its address.
+        fn-name (if identifier?
+                  (::value lowered-callee)
+                  (next-tmp!))
+        callee-statements (cond-> (::statements lowered-callee)
+                            (not identifier?)
+                            (conj (str "JANK_OBJECT " fn-name "{ " (::value lowered-callee) " };")))
+        {::keys [statements values]} (later-uses (identifier-names callee)
+                                                 #(lower-all arguments))]
+    (lowered (into callee-statements statements)
+             (let [[borrowing-arity borrowing-fn] (borrowing-fns (prelude-callee expression))]
+               (cond
+                 (and identifier?
+                      (nil? (::parse.spec/ns callee))
+                      (= (count values) (*direct-fns* fn-name)))
+                 (str (direct-fn-name fn-name)
+                      "("
+                      (clojure.string/join ", " values)
+                      ")")
+
+                 (and (= "get" (prelude-callee expression))
+                      (= 2 (count values))
+                      (constant-key? (second arguments)))
+                 (str "detail::get_ref("
+                      (first values)
+                      ", "
+                      (get-cache-name! (second values))
+                      ")")
+
+                 (= (count values) borrowing-arity)
+                 (str borrowing-fn
+                      "("
+                      (clojure.string/join ", " values)
+                      ")")
+
+                 :else
+                 (str "detail::invoke("
+                      (clojure.string/join ", " (cons (str "&" fn-name) values))
+                      ")"))))))
+
+(defn self-call?
+  "Whether the application calls the fn whose body it's within, with as many
+   arguments as it has parameters."
+  [expression]
+  (let [callee (::parse.spec/value expression)]
+    (and (= :identifier (::parse.spec/kind callee))
+         (self-name? callee)
+         (= (count (::parse.spec/arguments expression)) (::arity *self*)))))
 
 (defmethod expression->code :application
   [expression]
-  (let [fn-name (expression->code (::parse.spec/value expression))
-        arguments (mapv expression->code (::parse.spec/arguments expression))]
-    (str "detail::invoke("
-         (clojure.string/join ", " (cons (str "&" fn-name) arguments))
-         ")")))
+  ; Arithmetic on unboxed values only needs boxing once, for the result.
+  (if-some [typ (unboxed-type expression)]
+    (update (expression->unboxed expression) ::value (partial box typ))
+    (if (self-call? expression)
+      ; Fns call themselves directly, rather than through a function object.
+      (let [{::keys [statements values]} (lower-all (::parse.spec/arguments expression))]
+        (lowered statements ((::call *self*) values)))
+      (invocation->code expression))))
 
 (defmethod expression->code :default
   [expression]
   ; TODO: Throw NYI
-  "")
+  (lowered "JANK_NIL"))
+
+(defn top-level-fn? [expression]
+  (and (= :binding (::parse.spec/kind expression))
+       (= :fn (-> expression ::parse.spec/value ::parse.spec/kind))))
+
+(defn local-binding-names
+  "Returns the names of all bindings which aren't top-level defs, including fn
+   parameters and let bindings."
+  [expressions]
+  (->> expressions
+       (map #(if (= :binding (::parse.spec/kind %))
+               (::parse.spec/value %)
+               %))
+       (mapcat ast-nodes)
+       (filter #(and (map? %) (= :binding (::parse.spec/kind %))))
+       (map binding-name)
+       set))
+
+(defn direct-fns
+  "Finds the top-level fn defs which can be called directly. They need to be
+   defined only once and never shadowed by a local, so that every use of the
+   name refers to the same fn."
+  [expressions]
+  (let [def-counts (->> (filter #(= :binding (::parse.spec/kind %)) expressions)
+                        (map binding-name)
+                        frequencies)
+        locals (local-binding-names expressions)]
+    (into {}
+          (comp (filter top-level-fn?)
+                (filter #(= 1 (def-counts (binding-name %))))
+                (remove #(contains? locals (binding-name %)))
+                (map (fn [expression]
+                       [(codegen.sanitize/sanitize-str (binding-name expression))
+                        (-> expression ::parse.spec/value ::parse.spec/parameters count)])))
+          expressions)))
+
+(defn direct-fn-signature [expression]
+  (let [ident (codegen.sanitize/sanitize-str (binding-name expression))]
+    (str "JANK_OBJECT " (direct-fn-name ident)
+         "(" (parameters->code (-> expression ::parse.spec/value ::parse.spec/parameters)) ")")))
+
+(defn direct-fn-definition [expression]
+  (let [ident (codegen.sanitize/sanitize-str (binding-name expression))
+        value (::parse.spec/value expression)
+        self-names (fn-self-names value (binding-name expression))]
+    (str (direct-fn-signature expression) "\n"
+         (block (binding [*self* {::names self-names
+                                  ::arity (count (::parse.spec/parameters value))
+                                  ::call #(str (direct-fn-name ident)
+                                               "("
+                                               (clojure.string/join ", " %)
+                                               ")")
+                                  ::value ident}]
+                  (fn-body->statements value self-names {})))
+         "\n")))
+
+(def threaded-fns
+  "Prelude fns which run work on the thread pool, by sanitized name."
+  #{"pmapv" "preduce"})
+
+(defn threaded?
+  "Whether the program may use threads. Any reference to a threaded prelude
+   fn counts, even where it's shadowed, since a false positive only costs
+   atomic counts."
+  [expressions]
+  (boolean (some threaded-fns (identifier-names expressions))))
+
+(defn top-level->statements [expression]
+  (if (= :binding (::parse.spec/kind expression))
+    (let [ident (identifier->code (::parse.spec/identifier expression))]
+      (if (contains? *direct-fns* ident)
+        [(str ident " = detail::function{ &" (direct-fn-name ident) " };")]
+        (let [{::keys [statements value]} (expression->code (::parse.spec/value expression))]
+          (conj statements (str ident " = " value ";")))))
+    (expression->statements expression :discard)))
+
+; The program is split into translation units, so that the C++ compiler can
+; build them in parallel, and so that no one function is too big for it to
+; optimize. Each top-level expression gets its own unit, with its own
+; function, along with the direct fn it defines, if any, and the fns made
+; within it. The main unit defines the statics and the globals, and
+; _gen_poundmain, which runs each top-level function in order. Everything
+; which is shared between units is declared in the header, which is what
+; comes before the first unit; bin/jank splits the units apart on the marker.
+(def unit-marker "/* jank: unit */\n")
+
+(defn top-level-fn-name [index]
+  (str "_gen_top_level_" index))
+
+(defn top-level-unit
+  "Lowers the top-level expression into its own unit. Returns the unit's code,
+   along with what it needs declared in the header."
+  [index expression]
+  (binding [*locals* (atom {})
+            *movable* (atom #{})
+            *definitions* (atom [])]
+    (let [direct? (and (top-level-fn? expression)
+                       (contains? *direct-fns*
+                                  (codegen.sanitize/sanitize-str (binding-name expression))))
+          fn-definition (when direct?
+                          (direct-fn-definition expression))
+          main (block (top-level->statements expression))
+          signature (str "void " (top-level-fn-name index) "()")]
+      {::declarations (str (apply str (keep ::declaration @*definitions*))
+                           (when direct?
+                             (str (direct-fn-signature expression) ";\n"))
+                           signature ";\n")
+       ::code (str unit-marker
+                   "namespace _gen_program\n{\n"
+                   (apply str (map ::definition @*definitions*))
+                   fn-definition
+                   signature "\n"
+                   main
+                   "\n}\n")})))
+
+(defn program-facts
+  "What lowering needs to know about the whole program up front."
+  [expressions]
+  (let [globals (->> (filter #(= :binding (::parse.spec/kind %)) expressions)
+                     (map (comp codegen.sanitize/sanitize-str binding-name))
+                     distinct)]
+    {::direct-fns (direct-fns expressions)
+     ::globals (set globals)
+     ::global-order globals
+     ::threaded? (threaded? expressions)}))
+
+(defn name-facts
+  "What lowering knows about the name from the whole program. Lowering a form
+   depends on these, for each name within it, along with the forms before
+   it."
+  [facts name]
+  (let [ident (codegen.sanitize/sanitize-str name)]
+    [(get (::direct-fns facts) ident)
+     (contains? (::globals facts) ident)]))
+
+(def new-statics
+  "The statics before any form is lowered. Each kind is only ever added to,
+   in order of use."
+  {::keywords []
+   ::shapes []
+   ::constants []
+   ::get-caches []
+   ::tmp-counter 0})
+
+(defn generate-unit
+  "Lowers the top-level expression into its own unit, given the statics
+   which the expressions before it left. Returns the unit, along with the
+   statics for the expressions after it."
+  [facts statics index expression]
+  (binding [*direct-fns* (::direct-fns facts)
+            *globals* (::globals facts)
+            *keywords* (atom (::keywords statics))
+            *shapes* (atom (::shapes statics))
+            *constants* (atom (::constants statics))
+            *get-caches* (atom (::get-caches statics))
+            *tmp-counter* (atom (::tmp-counter statics))]
+    [(top-level-unit index expression)
+     {::keywords @*keywords*
+      ::shapes @*shapes*
+      ::constants @*constants*
+      ::get-caches @*get-caches*
+      ::tmp-counter @*tmp-counter*}]))
+
+(defn assemble
+  "Puts the units together with the header and the main unit, which need
+   every static which the units found."
+  [facts statics units]
+  (let [globals (::global-order facts)]
+    ; TODO: Maintain proper indentation for sane formatting
+    ; Top-level defs live in their own namespace so that they can shadow
+    ; prelude fns, just as locals do.
+    ; bin/jank looks for this marker to build without atomic counts.
+    (str (when-not (::threaded? facts)
+           "/* jank: single threaded */\n")
+         "namespace _gen_program\n{\n"
+         (apply str (map-indexed keyword-declaration (::keywords statics)))
+         (apply str (map-indexed shape-declaration (::shapes statics)))
+         (apply str (map-indexed constant-declaration (::constants statics)))
+         (apply str (map-indexed get-cache-declaration (::get-caches statics)))
+         (apply str (map #(str "extern JANK_OBJECT " % ";\n") globals))
+         (apply str (map ::declarations units))
+         "void _gen_poundmain();\n"
+         "}\n"
+         "using _gen_program::_gen_poundmain;\n"
+
+         unit-marker
+         "namespace _gen_program\n{\n"
+         ; Shapes may use keywords, so those come first. Constants may be
+         ; records, which use shapes. Get caches are keyed by keywords and
+         ; constants, so they need to be made after both.
+         (apply str (map-indexed keyword-definition (::keywords statics)))
+         (apply str (map-indexed shape-definition (::shapes statics)))
+         (apply str (map-indexed constant-definition (::constants statics)))
+         (apply str (map-indexed get-cache-definition (::get-caches statics)))
+         (apply str (map #(str "JANK_OBJECT " % ";\n") globals))
+         "void _gen_poundmain()\n{\n"
+         (apply str (map #(str (top-level-fn-name %) "();\n")
+                         (range (count units))))
+         "}\n}\n"
+
+         (apply str (map ::code units)))))
 
 ; TODO: Spec
 (defn generate [expressions]
-  (let [code ""]
-    ; TODO: Maintain proper indentation for sane formatting
-    (str "void _gen_poundmain()\n{"
-         (reduce (fn [acc expression]
-                   ;(pprint "generating for " expression)
-                   (str acc "\n" (expression->code expression)))
-                 code
-                 [{::parse.spec/kind :do
-                   ::parse.spec/body (butlast expressions)
-                   ::parse.spec/return (last expressions)}])
-         "\n;}")))
+  (let [facts (program-facts expressions)
+        ; Statics, like shapes, are found while lowering, so every unit is
+        ; lowered first.
+        [units statics] (reduce (fn [[units statics] [index expression]]
+                                  (let [[unit statics] (generate-unit facts statics index expression)]
+                                    [(conj units unit) statics]))
+                                [[] new-statics]
+                                (map-indexed vector expressions))]
+    (assemble facts statics units)))
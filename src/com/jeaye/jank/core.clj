@@ -3,15 +3,146 @@
   (:require [com.jeaye.jank.parse :as parse]
             [com.jeaye.jank.parse.binding :as parse.binding]
             [com.jeaye.jank.parse.spec :as parse.spec]
+            [com.jeaye.jank.fold.core :as fold.core]
             [com.jeaye.jank.inference.core :as inference.core]
-            [com.jeaye.jank.codegen :as codegen]))
+            [com.jeaye.jank.codegen :as codegen]
+            [com.jeaye.jank.cache :as cache]))
 
+(defn compiler-fingerprint
+  "A digest of the compiler's own source, so that changing the compiler
+   misses everything it cached before."
+  []
+  (cache/fingerprint (concat (cache/namespace-resources "com.jeaye.jank")
+                             parse/form-resources
+                             [parse/prelude-file])))
+
+(defn form-facts
+  "The whole-program facts which compiling the form depends on: what folding
+   and codegen know about each name within it."
+  [fold-context codegen-facts expression]
+  (->> (fold.core/ast-nodes expression)
+       (filter #(fold.core/kind? :identifier %))
+       (map ::parse.spec/name)
+       distinct
+       (sort-by str)
+       (map (juxt identity
+                  #(fold.core/name-facts fold-context %)
+                  #(codegen/name-facts codegen-facts %)))))
+
+(defn form-keys
+  "A cache key for each form, from the form, the facts it depends on, and the
+   key of the form before it, so each key covers every form up to it."
+  [fingerprint fold-context codegen-facts expressions]
+  (rest (reductions (fn [previous expression]
+                      (cache/digest [previous
+                                     (cache/edn-str expression)
+                                     (cache/edn-str (form-facts fold-context
+                                                                codegen-facts
+                                                                expression))]))
+                    fingerprint
+                    expressions)))
+
+(defn statics-delta
+  "The statics which were added, since each kind only grows."
+  [old new]
+  (reduce-kv (fn [delta k v]
+               (assoc delta k (if (vector? v)
+                                (subvec v (count (get old k)))
+                                v)))
+             {}
+             new))
+
+(defn compile-form!
+  "Folds, infers, and lowers one top-level form, given the state which the
+   forms before it left. Returns the new state, along with the cache entry
+   which gets from the old state to it."
+  [state codegen-facts substitutions index expression]
+  (let [[folded fold-context] (fold.core/fold-form (::fold state) expression)
+        res (inference.core/infer-form folded (::scope state) substitutions)
+        [unit statics] (codegen/generate-unit codegen-facts
+                                              (::statics state)
+                                              index
+                                              (::inference.core/expression res))]
+    [(-> state
+         (assoc ::fold fold-context
+                ::scope (::inference.core/scope res)
+                ::statics statics)
+         (update ::units conj unit))
+     {::unit unit
+      ::fold (cache/map-delta (::fold state) fold-context)
+      ::scope (cache/map-delta (::scope state) (::inference.core/scope res))
+      ::writes (::inference.core/writes res)
+      ::statics (statics-delta (::statics state) statics)
+      ::counters [@inference.core/type-counter*
+                  @inference.core/scope-path-key-counter*]}]))
+
+(defn restore-form!
+  "Applies a cached entry from compile-form! to the state, as though the form
+   had been compiled again."
+  [state substitutions entry]
+  (inference.core/replay-writes! substitutions (::writes entry))
+  (let [[types scope-paths] (::counters entry)]
+    (reset! inference.core/type-counter* types)
+    (reset! inference.core/scope-path-key-counter* scope-paths))
+  (-> state
+      (update ::fold cache/apply-map-delta (::fold entry))
+      (update ::scope cache/apply-map-delta (::scope entry))
+      (update ::statics #(reduce-kv (fn [statics k v]
+                                      (if (vector? v)
+                                        (update statics k into v)
+                                        (assoc statics k v)))
+                                    %
+                                    (::statics entry)))
+      (update ::units conj (::unit entry))))
+
+; Folding, inference, and codegen carry what they learn from each form into
+; the next, in order, so a changed form can change how any form after it is
+; compiled. Each form's results are cached under a key which covers every form
+; up to it, along with what each needs to know about the whole program, which
+; is cheap to find again. So a build restores the forms before the first one
+; which changed, and compiles the rest.
+(defn compile-program [expressions]
+  (reset! inference.core/type-counter* 0)
+  (reset! inference.core/scope-path-key-counter* 0)
+  (let [fold-context (fold.core/program-context expressions)
+        codegen-facts (codegen/program-facts expressions)
+        substitutions (inference.core/new-substitutions)
+        fingerprint (compiler-fingerprint)
+        ; Without a fingerprint, nothing is cached.
+        cache-keys (if (some? fingerprint)
+                     (form-keys fingerprint fold-context codegen-facts expressions)
+                     (repeat nil))
+        state (reduce (fn [state [index expression key]]
+                        (if-some [entry (some->> key
+                                                 (cache/entry-file "compiled")
+                                                 cache/read-entry)]
+                          (restore-form! state substitutions entry)
+                          (let [[state entry] (compile-form! state
+                                                             codegen-facts
+                                                             substitutions
+                                                             index
+                                                             expression)]
+                            (when (some? key)
+                              (cache/write-entry! (cache/entry-file "compiled" key)
+                                                  entry))
+                            state)))
+                      {::fold fold-context
+                       ::scope {}
+                       ::statics codegen/new-statics
+                       ::units []}
+                      (map vector (range) expressions cache-keys))]
+    (codegen/assemble codegen-facts (::statics state) (::units state))))
+
+; Parsing is cached per top-level form, and so is everything after it; see
+; compile-program. The output for a whole file is cached too, so an unchanged
+; file doesn't even need to be parsed.
 (defn parse+codegen [file]
-  (binding [parse.binding/*input-file* file
-            parse.binding/*input-source* (slurp file)]
-    (let [parse-tree (parse/parse parse/prelude)
-          code (codegen/generate parse-tree)]
-      code)))
+  (let [source (slurp file)]
+    (binding [parse.binding/*input-file* file
+              parse.binding/*input-source* source]
+      (cache/lookup "output"
+                    (some->> (compiler-fingerprint) (vector source) cache/digest)
+                    #(compile-program (parse/parse-forms parse/prelude))))))
 
 (defn -main [& args]
   (println (parse+codegen (first args)))
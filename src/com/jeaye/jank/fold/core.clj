@@ -0,0 +1,261 @@
+(ns com.jeaye.jank.fold.core
+  (:require [clojure.walk :refer [postwalk]]
+            [com.jeaye.jank.parse.spec :as parse.spec]))
+
+; Constant folding happens between parsing and inference. Applications of
+; pure prelude fns to literals are evaluated here, at compile time, and so are
+; applications of simple top-level fns to literals, by substituting their
+; arguments into their bodies. Codegen then builds the resulting collections
+; once, as statics.
+
+(def max-depth
+  "How many nested fn applications are folded into one another. This keeps
+   recursive fns from folding forever."
+  8)
+
+(defn ast-nodes [expression]
+  (tree-seq coll?
+            #(if (map? %)
+               (vals %)
+               %)
+            expression))
+
+(defn kind? [kind expression]
+  (and (map? expression) (= kind (::parse.spec/kind expression))))
+
+(defn binding-name [expression]
+  (-> expression ::parse.spec/identifier ::parse.spec/name))
+
+(defn literal-children [expression]
+  (case (::parse.spec/type expression)
+    (:vector :set) (::parse.spec/values expression)
+    :map (mapcat (juxt ::parse.spec/key ::parse.spec/value) (::parse.spec/values expression))
+    []))
+
+(defn literal?
+  "Whether the expression is a literal made only of other literals, so its
+   value is known at compile time and never changes."
+  [expression]
+  (and (kind? :constant expression)
+       (not= :regex (::parse.spec/type expression))
+       (every? literal? (literal-children expression))))
+
+(defn number-constant
+  "A constant for the number, if it can be represented exactly as one."
+  [value]
+  (cond
+    (integer? value) {::parse.spec/kind :constant
+                      ::parse.spec/type :integer
+                      ::parse.spec/value (long value)}
+    (and (double? value) (Double/isFinite value)) {::parse.spec/kind :constant
+                                                   ::parse.spec/type :real
+                                                   ::parse.spec/value value}))
+
+(defn boolean-constant [value]
+  {::parse.spec/kind :constant
+   ::parse.spec/type :boolean
+   ::parse.spec/value (boolean value)})
+
+(defn numbers [arguments]
+  (when (every? #(#{:integer :real} (::parse.spec/type %)) arguments)
+    (map ::parse.spec/value arguments)))
+
+(defn numeric
+  "Folds a fn of numbers. Integers stay integers, with integer-op, unless any
+   argument is real, in which case they're all promoted, as in the prelude.
+   Integer overflow and division by zero are left for runtime."
+  [integer-op real-op]
+  (fn [arguments]
+    (when-some [values (numbers arguments)]
+      (try
+        (number-constant (if (some double? values)
+                           (apply real-op (map double values))
+                           (apply integer-op values)))
+        (catch ArithmeticException _
+          nil)))))
+
+(defn real-fn
+  "Folds a fn which always returns a real, like sqrt."
+  [f]
+  (fn [arguments]
+    (when-some [values (numbers arguments)]
+      (number-constant (apply f (map double values))))))
+
+(defn comparison [f]
+  (fn [arguments]
+    (when-some [values (numbers arguments)]
+      (boolean-constant (apply f values)))))
+
+(def scalar-types
+  "Constant types which compare equal exactly when their types and values do.
+   Keywords aren't included, since :a and ::a may or may not be equal,
+   depending on the namespace."
+  #{:nil :boolean :integer :real :string})
+
+(defn equality [f]
+  (fn [arguments]
+    (when (every? (comp scalar-types ::parse.spec/type) arguments)
+      (boolean-constant (f (apply = (map (juxt ::parse.spec/type ::parse.spec/value)
+                                         arguments)))))))
+
+(defn truthy? [expression]
+  (not (or (= :nil (::parse.spec/type expression))
+           (and (= :boolean (::parse.spec/type expression))
+                (false? (::parse.spec/value expression))))))
+
+(def pure-fns
+  "Prelude fns which can be evaluated at compile time, given literals, along
+   with their parameter counts. Each takes the argument constants and returns
+   the result constant, or nil if it can't be folded. These match what the
+   prelude does at runtime."
+  {"+" [2 (numeric #(Math/addExact (long %1) (long %2)) +)]
+   "-" [2 (numeric #(Math/subtractExact (long %1) (long %2)) -)]
+   "*" [2 (numeric #(Math/multiplyExact (long %1) (long %2)) *)]
+   "div" [2 (numeric quot /)]
+   "mod" [2 (numeric rem #(double (rem (long %1) (long %2))))]
+   "min" [2 (numeric min min)]
+   "inc" [1 (numeric #(Math/incrementExact (long %)) inc)]
+   "dec" [1 (numeric #(Math/decrementExact (long %)) dec)]
+   "abs" [1 (numeric #(if (neg? %) (Math/negateExact (long %)) %) #(Math/abs (double %)))]
+   "sqrt" [1 (real-fn #(Math/sqrt %))]
+   "tan" [1 (real-fn #(Math/tan %))]
+   "pow" [2 (real-fn #(Math/pow %1 %2))]
+   "->int" [1 (fn [arguments]
+                (when-some [[value] (numbers arguments)]
+                  (when (< -9.2e18 value 9.2e18)
+                    (number-constant (long value)))))]
+   "->float" [1 (real-fn identity)]
+   "<" [2 (comparison <)]
+   "<=" [2 (comparison <=)]
+   "=" [2 (equality identity)]
+   "not=" [2 (equality not)]
+   "nil?" [1 (fn [[argument]]
+               (boolean-constant (= :nil (::parse.spec/type argument))))]
+   "some?" [1 (fn [[argument]]
+                (boolean-constant (not= :nil (::parse.spec/type argument))))]
+   "truthy?" [1 (fn [[argument]]
+                  (boolean-constant (truthy? argument)))]})
+
+(defn substitute
+  "Replaces each unqualified identifier which names a key in replacements."
+  [expression replacements]
+  (postwalk #(if (and (kind? :identifier %)
+                      (nil? (::parse.spec/ns %))
+                      (contains? replacements (::parse.spec/name %)))
+               (replacements (::parse.spec/name %))
+               %)
+            expression))
+
+(declare fold-expression)
+
+(defn fold-application [expression context depth]
+  (let [callee (::parse.spec/value expression)
+        arguments (::parse.spec/arguments expression)
+        fn-name (when (and (kind? :identifier callee)
+                           (nil? (::parse.spec/ns callee)))
+                  (::parse.spec/name callee))
+        user-fn (get-in context [::fns fn-name])]
+    (or (when (and (some? fn-name) (every? literal? arguments))
+          (cond
+            (and (some? user-fn)
+                 (< depth max-depth)
+                 (= (count arguments) (count (::parse.spec/parameters user-fn))))
+            (let [parameters (map binding-name (::parse.spec/parameters user-fn))
+                  body (-> user-fn ::parse.spec/body ::parse.spec/return)
+                  folded (fold-expression (substitute body (zipmap parameters arguments))
+                                          context
+                                          (inc depth))]
+              (when (literal? folded)
+                folded))
+
+            (and (contains? pure-fns fn-name)
+                 (not (contains? (::shadowed context) fn-name))
+                 (= (count arguments) (first (pure-fns fn-name))))
+            ((second (pure-fns fn-name)) arguments)))
+        expression)))
+
+(defn fold-expression [expression context depth]
+  (postwalk #(if (kind? :application %)
+               (fold-application % context depth)
+               %)
+            (substitute expression (::constants context))))
+
+(defn simple-fn?
+  "Whether the fn's body is a single expression made only of literals,
+   identifiers, and applications. Those can be folded by substituting the
+   arguments for the parameters."
+  [expression]
+  (let [body (::parse.spec/body expression)]
+    (and (empty? (::parse.spec/body body))
+         (every? #(or (not (map? %))
+                      (not (contains? % ::parse.spec/kind))
+                      (#{:constant :identifier :application} (::parse.spec/kind %)))
+                 (ast-nodes (::parse.spec/return body))))))
+
+(defn local-binding-names
+  "The names of all bindings which aren't top-level defs, including fn
+   parameters and let bindings."
+  [expressions]
+  (->> expressions
+       (map #(if (kind? :binding %)
+               (::parse.spec/value %)
+               %))
+       (mapcat ast-nodes)
+       (filter #(kind? :binding %))
+       (map binding-name)
+       set))
+
+(defn program-context
+  "The context which folding starts from. Top-level defs which are only
+   defined once, and never shadowed by a local, can be folded into the forms
+   which follow them, so that needs to be known about the whole program up
+   front."
+  [expressions]
+  (let [locals (local-binding-names expressions)
+        def-counts (->> (filter #(kind? :binding %) expressions)
+                        (map binding-name)
+                        frequencies)]
+    {::fns {}
+     ::constants {}
+     ::shadowed (into locals (keys def-counts))
+     ::foldable (into #{}
+                      (comp (filter #(= 1 (val %)))
+                            (map key)
+                            (remove locals))
+                      def-counts)}))
+
+(defn name-facts
+  "What folding knows about the name from the whole program. Folding a form
+   depends on these, for each name within it, along with the forms before
+   it."
+  [context name]
+  [(contains? (::shadowed context) name)
+   (contains? (::foldable context) name)])
+
+(defn fold-form
+  "Folds constants within one top-level form, given the context which the
+   forms before it left. Returns the folded form, along with the context for
+   the forms after it."
+  [context expression]
+  (let [expression (fold-expression expression context 0)
+        value (::parse.spec/value expression)
+        foldable? (and (kind? :binding expression)
+                       (contains? (::foldable context) (binding-name expression)))]
+    [expression
+     (cond-> context
+       (and foldable? (literal? value))
+       (assoc-in [::constants (binding-name expression)] value)
+
+       (and foldable? (kind? :fn value) (simple-fn? value))
+       (assoc-in [::fns (binding-name expression)] value))]))
+
+(defn fold
+  "Folds constants within each top-level form. Top-level defs which are only
+   defined once, to a literal or a simple fn, and never shadowed are also
+   folded into the forms which follow them."
+  [expressions]
+  (first (reduce (fn [[folded context] expression]
+                   (let [[expression context] (fold-form context expression)]
+                     [(conj folded expression) context]))
+                 [[] (program-context expressions)]
+                 expressions)))
@@ -1,5 +1,6 @@
 (ns com.jeaye.jank.inference.core
   (:require [clojure.string]
+            [clojure.walk :refer [postwalk]]
             [orchestra.core :refer [defn-spec]]
             [com.jeaye.jank.log :refer [pprint]]
             [com.jeaye.jank.parse.spec :as parse.spec]))
@@ -11,24 +12,49 @@
 
 (defn scope-lookup [scope scope-path bind]
   (loop [scope-path scope-path]
-    (let [local-scope (get-in scope scope-path)]
-      (cond
-        (empty? scope-path)
-        nil
-
-        (nil? local-scope)
-        (recur (pop scope-path))
-
-        :else
-        (if-some [names (::names local-scope)]
-          (if-some [found (get names bind)]
-            found
-            (recur (pop scope-path)))
-          (recur (pop scope-path)))))))
-
-(let [scope-path-key-counter* (atom 0)]
-  (defn next-scope-path-key! [base]
-    (keyword (str (name base) "#" (swap! scope-path-key-counter* inc)))))
+    (if-some [found (get-in scope (conj scope-path ::names bind))]
+      found
+      (when-not (empty? scope-path)
+        (recur (pop scope-path))))))
+
+(def prelude-types
+  "Known types of prelude fns, as a parameter count and a return type. The
+   parameter types are left unknown, since these accept anything."
+  {"rand" [0 "real"]
+   "rand-int" [1 "integer"]
+   "sqrt" [1 "real"]
+   "tan" [1 "real"]
+   "pow" [2 "real"]
+   "->int" [1 "integer"]
+   "->float" [1 "real"]
+   "<" [2 "boolean"]
+   "<=" [2 "boolean"]
+   "=" [2 "boolean"]
+   "not=" [2 "boolean"]
+   "some?" [1 "boolean"]
+   "nil?" [1 "boolean"]
+   "truthy?" [1 "boolean"]})
+
+(def numeric-fns
+  "Prelude fns which return an integer when given only integers and a real
+   when given any real. Their types depend on their arguments, so they're
+   solved after unification; see `solve-numeric`."
+  #{"+" "-" "*" "div" "mod" "min" "inc" "dec" "abs"})
+
+(defn prelude-type
+  "Builds a new instance of a prelude fn's type, so that each use of the fn
+   can be unified independently."
+  [fn-name]
+  (if-some [[param-count return-type] (prelude-types fn-name)]
+    {::type-kind ::function
+     ::parameter-types (vec (repeatedly param-count next-typename!))
+     ::return-type {::type-kind ::single
+                    ::name return-type}}
+    (next-typename!)))
+
+(def scope-path-key-counter* (atom 0))
+(defn next-scope-path-key! [base]
+  (keyword (str (name base) "#" (swap! scope-path-key-counter* inc))))
 
 (defn scope-add-binding
   ([scope scope-path bind-name bind-type]
@@ -37,6 +63,13 @@
    (-> (scope-add-binding scope scope-path bind-name bind-type)
        (update-in (conj scope-path ::types) assoc bind-name value-type))))
 
+(defn add-recur-target
+  "Adds the types of a loop's or fn's bindings, which recur rebinds. These are
+   looked up like any other binding, so the nearest loop or fn is found. The
+   key can't clash with a binding, since binding names are strings."
+  [scope scope-path bindings]
+  (scope-add-binding scope scope-path ::recur (mapv ::type bindings)))
+
 (defmulti assign-typenames
   (fn [expression scope scope-path]
     (::parse.spec/kind expression)))
@@ -49,14 +82,17 @@
                    :integer "integer"
                    :real "real"
                    :string "string"
+                   :keyword "keyword"
                    :regex "regex"
                    :map "map" ; TODO: Parameterize?
                    :vector "vector" ; TODO: Parameterize?
                    :set "set" ; TODO: Parameterize?
-                   )]
+                   nil)]
     {::expression (assoc expression
-                         ::type {::type-kind ::single
-                                 ::name typename}
+                         ::type (if (some? typename)
+                                  {::type-kind ::single
+                                   ::name typename}
+                                  (next-typename!))
                          ::scope-path scope-path)
      ::scope scope}))
 
@@ -96,16 +132,18 @@
 
 (defmethod assign-typenames :identifier
   [expression scope scope-path]
-  ; TODO: Unresolved is ok; check again at the end.
+  ; TODO: Check again at the end, once prelude fns are in scope.
   (if-some [ident-type (scope-lookup scope scope-path (::parse.spec/name expression))]
     {::expression (assoc expression
                          ::type ident-type
                          ::scope-path scope-path)
      ::scope scope}
-    (do
-      (pprint {:scope scope
-               :scope-path scope-path})
-      (assert false (str "error: unknown identifier " (::parse.spec/name expression))))))
+    ; Unresolved identifiers are assumed to come from the prelude.
+    {::expression (assoc expression
+                         ::type (prelude-type (::parse.spec/name expression))
+                         ::scope-path scope-path
+                         ::prelude? true)
+     ::scope scope}))
 
 (defmethod assign-typenames :fn
   [expression scope scope-path]
@@ -117,7 +155,11 @@
                              {::parse.spec/parameters []
                               ::scope scope}
                              (::parse.spec/parameters expression))
-        body (assign-typenames (::parse.spec/body expression) (::scope scope+params) fn-scope-path)
+        body (assign-typenames (::parse.spec/body expression)
+                               (add-recur-target (::scope scope+params)
+                                                 fn-scope-path
+                                                 (::parse.spec/parameters scope+params))
+                               fn-scope-path)
         fn-type {::type-kind ::function
                  ::parameter-types (map ::type (::parse.spec/parameters scope+params))
                  ::return-type (-> body ::expression ::parse.spec/return ::type)}]
@@ -168,6 +210,45 @@
                          ::parse.spec/body (::expression scope+body))
      ::scope (::scope scope+body)}))
 
+(defmethod assign-typenames :loop
+  [expression scope scope-path]
+  (let [loop-scope-path (conj scope-path (next-scope-path-key! :loop))
+        scope+bindings (reduce (fn [acc bind]
+                                 (let [res (assign-typenames bind (::scope acc) loop-scope-path)]
+                                   (-> (assoc acc ::scope (::scope res))
+                                       (update ::parse.spec/bindings conj (::expression res)))))
+                               {::parse.spec/bindings []
+                                ::scope scope}
+                               (::parse.spec/bindings expression))
+        scope+body (assign-typenames (::parse.spec/body expression)
+                                     (add-recur-target (::scope scope+bindings)
+                                                       loop-scope-path
+                                                       (::parse.spec/bindings scope+bindings))
+                                     loop-scope-path)]
+    {::expression (assoc expression
+                         ::type (-> scope+body ::expression ::type)
+                         ::scope-path scope-path
+                         ::parse.spec/bindings (::parse.spec/bindings scope+bindings)
+                         ::parse.spec/body (::expression scope+body))
+     ::scope (::scope scope+body)}))
+
+(defmethod assign-typenames :recur
+  [expression scope scope-path]
+  (let [arguments (reduce (fn [acc arg-expr]
+                            (let [res (assign-typenames arg-expr (::scope acc) scope-path)]
+                              (-> (assoc acc ::scope (::scope res))
+                                  (update ::parse.spec/arguments conj (::expression res)))))
+                          {::parse.spec/arguments []
+                           ::scope scope}
+                          (::parse.spec/arguments expression))]
+    ; recur never delivers a value, so its type is left free.
+    {::expression (assoc expression
+                         ::type (next-typename!)
+                         ::scope-path scope-path
+                         ::recur-types (scope-lookup scope scope-path ::recur)
+                         ::parse.spec/arguments (::parse.spec/arguments arguments))
+     ::scope (::scope arguments)}))
+
 (defmethod assign-typenames :application
   [expression scope scope-path]
   (let [fn-name-expr (assign-typenames (::parse.spec/value expression) scope scope-path)
@@ -257,6 +338,25 @@
         equations (generate-equations (::parse.spec/body expression) equations scope)]
     (conj equations [(::type expression) (-> expression ::parse.spec/body ::type)])))
 
+(defmethod generate-equations :loop
+  [expression equations scope]
+  (let [equations (reduce (fn [acc bind]
+                            (generate-equations bind acc scope))
+                          equations
+                          (::parse.spec/bindings expression))
+        equations (generate-equations (::parse.spec/body expression) equations scope)]
+    (conj equations [(::type expression) (-> expression ::parse.spec/body ::type)])))
+
+(defmethod generate-equations :recur
+  [expression equations scope]
+  (let [equations (reduce (fn [acc arg-expr]
+                            (generate-equations arg-expr acc scope))
+                          equations
+                          (::parse.spec/arguments expression))]
+    ; Each binding needs to hold every value it's rebound to.
+    (into equations
+          (map vector (::recur-types expression) (map ::type (::parse.spec/arguments expression))))))
+
 (defmethod generate-equations :application
   [expression equations scope]
   (let [fn-side {::type-kind ::function
@@ -287,103 +387,187 @@
   [expression equations scope]
    equations)
 
+; Type variables are solved with union-find. Each variable's name maps to its
+; parent: either another variable, within the same class, or, at the root,
+; the type which the whole class is bound to. Finding a root compresses the
+; path to it, and classes are linked by rank, so lookups stay near constant
+; however long the program is. The maps are mutable, so every write is also
+; recorded on a trail, which lets unification which fails part way be undone.
+(defn new-substitutions []
+  {::parents (java.util.HashMap.)
+   ::ranks (java.util.HashMap.)
+   ::trail (java.util.ArrayList.)})
+
+(defn put-entry! [substitutions ^java.util.HashMap entries k v]
+  (.add ^java.util.ArrayList (::trail substitutions) [entries k (.get entries k)])
+  (.put entries k v))
+
+(defn mark
+  "Where the trail is now, to roll back to."
+  [substitutions]
+  (.size ^java.util.ArrayList (::trail substitutions)))
+
+(defn rollback!
+  "Undoes every write since the mark."
+  [substitutions mark]
+  (let [^java.util.ArrayList trail (::trail substitutions)]
+    (while (< mark (.size trail))
+      (let [[^java.util.HashMap entries k old] (.remove trail (dec (.size trail)))]
+        (if (some? old)
+          (.put entries k old)
+          (.remove entries k))))))
+
+(defn commit!
+  "Forgets the trail, once nothing written to it will be rolled back."
+  [substitutions]
+  (.clear ^java.util.ArrayList (::trail substitutions)))
+
+(defn trail-writes
+  "Each entry written since the last commit, with its value now, so that the
+   writes can be replayed onto other substitutions."
+  [substitutions]
+  (let [parents (::parents substitutions)]
+    (into []
+          (comp (map (fn [[entries k _]]
+                       [(if (identical? entries parents) ::parents ::ranks) k]))
+                (distinct)
+                (map (fn [[entries-key k]]
+                       [entries-key k (.get ^java.util.HashMap (entries-key substitutions) k)])))
+          (::trail substitutions))))
+
+(defn replay-writes!
+  "Writes what trail-writes returned, without any trail."
+  [substitutions writes]
+  (doseq [[entries-key k v] writes]
+    (.put ^java.util.HashMap (entries-key substitutions) k v))
+  substitutions)
+
+(defn prune
+  "Returns the type which a variable is bound to, or the variable at the root
+   of its class, if that's unbound. Other types are returned as they are."
+  [typ substitutions]
+  (if (not= ::unknown (::type-kind typ))
+    typ
+    (let [^java.util.HashMap parents (::parents substitutions)]
+      (if-some [parent (.get parents (::name typ))]
+        (let [root (prune parent substitutions)]
+          (when-not (identical? root parent)
+            (put-entry! substitutions parents (::name typ) root))
+          root)
+        typ))))
+
 (defn occurs?
-  "Returns whether or not `v` occurs within `typ`."
+  "Returns whether or not `v`, an unbound root, occurs within `typ`."
   [v typ substitutions]
   ;(println "occurs?" v typ substitutions)
-  (if (= v typ)
-    true
-    (if-let [sub (and (= ::unknown (::type-kind typ)) (get substitutions (::name typ)))]
-      (occurs? v sub substitutions)
+  (let [typ (prune typ substitutions)]
+    (if (= v typ)
+      true
       (if (= ::function (::type-kind typ))
         (boolean (or (occurs? v (::return-type typ) substitutions)
                      (some #(occurs? v % substitutions) (::parameter-types typ))))
         false))))
 
-(declare unify)
-(defn unify-variable [v typ substitutions]
-  ;(println "unify-variable" v typ substitutions)
-  (if-some [sub (get substitutions (::name v))]
-    (unify sub typ substitutions)
-    (if-let [sub (and (= ::unknown (::type-kind typ)) (get substitutions (::name typ)))]
-      (unify v sub substitutions)
-      (if (occurs? v typ substitutions)
-        ; Self-recurring types can't be unified.
-        (do
-          (println "error:" v "occurs within" typ)
-          nil)
-        (assoc substitutions (::name v) typ)))))
+(defn link-variables!
+  "Links the classes of two unbound roots, putting the shallower one under
+   the deeper one."
+  [left right substitutions]
+  (let [^java.util.HashMap ranks (::ranks substitutions)
+        left-rank (.getOrDefault ranks (::name left) 0)
+        right-rank (.getOrDefault ranks (::name right) 0)]
+    (cond
+      (< left-rank right-rank)
+      (put-entry! substitutions (::parents substitutions) (::name left) right)
+
+      (< right-rank left-rank)
+      (put-entry! substitutions (::parents substitutions) (::name right) left)
+
+      :else
+      (do
+        (put-entry! substitutions (::parents substitutions) (::name right) left)
+        (put-entry! substitutions ranks (::name left) (inc left-rank))))
+    substitutions))
+
+(defn bind-variable!
+  "Binds an unbound root to a type, which isn't a variable."
+  [v typ substitutions]
+  ;(println "bind-variable!" v typ substitutions)
+  (if (occurs? v typ substitutions)
+    ; Self-recurring types can't be unified.
+    nil
+    (do
+      (put-entry! substitutions (::parents substitutions) (::name v) typ)
+      substitutions)))
 
 (defn unify [left right substitutions]
   ;(println "unify" left right substitutions)
-  (cond
+  (if (nil? substitutions)
     ; Error propogation.
-    (nil? substitutions)
     nil
-
-    ; Already concrete.
-    (= left right)
-    substitutions
-
-    (= ::unknown (::type-kind left))
-    (unify-variable left right substitutions)
-
-    (= ::unknown (::type-kind right))
-    (unify-variable right left substitutions)
-
-    (and (= ::function (::type-kind left))
-         (= ::function (::type-kind right)))
-    (if-not (= (-> left ::parameter-types count)
-               (-> right ::parameter-types count))
-      ; We can't unify these incompatible fns.
-      (do
-        (println "error: incompatible fn arities" left "and" right)
-        nil)
-      (let [substitutions (unify (::return-type left) (::return-type right) substitutions)]
-        (reduce (fn [acc [left-param right-param]]
-                  (unify-variable left-param right-param acc))
-                substitutions
-                (map vector (::parameter-types left) (::parameter-types right)))))
-
-    ; Shouldn't happen.
-    :else
-    (do
-      (println "error: unable to unify" left "and" right)
-      nil)))
-
-(defn unify-equations [equations]
-  (let [substitutions {}]
-    (reduce (fn [acc [left right]]
-              (if-some [new-acc (unify left right acc)]
-                new-acc
-                (reduced nil)))
-            substitutions
-            equations)))
-
-(defn apply-substitutions [typ substitutions]
-  (cond
-    (nil? substitutions)
-    nil
-
-    (empty? substitutions)
-    typ
-
-    (not (contains? #{::unknown ::function} (::type-kind typ)))
-    typ
-
-    (= ::unknown (::type-kind typ))
-    (if-some [sub (get substitutions (::name typ))]
-      (apply-substitutions sub substitutions)
-      typ)
-
-    (= ::function (::type-kind typ))
-    (-> typ
-        (update ::return-type apply-substitutions substitutions)
-        (update ::parameter-types (fn [param-types]
-                                    (map #(apply-substitutions % substitutions) param-types))))
-
-    :else
-    nil))
+    (let [left (prune left substitutions)
+          right (prune right substitutions)]
+      (cond
+        ; Already concrete.
+        (= left right)
+        substitutions
+
+        (and (= ::unknown (::type-kind left))
+             (= ::unknown (::type-kind right)))
+        (link-variables! left right substitutions)
+
+        (= ::unknown (::type-kind left))
+        (bind-variable! left right substitutions)
+
+        (= ::unknown (::type-kind right))
+        (bind-variable! right left substitutions)
+
+        (and (= ::function (::type-kind left))
+             (= ::function (::type-kind right)))
+        (if-not (= (-> left ::parameter-types count)
+                   (-> right ::parameter-types count))
+          ; We can't unify these incompatible fns.
+          nil
+          (let [substitutions (unify (::return-type left) (::return-type right) substitutions)]
+            (reduce (fn [acc [left-param right-param]]
+                      (unify left-param right-param acc))
+                    substitutions
+                    (map vector (::parameter-types left) (::parameter-types right)))))
+
+        ; Shouldn't happen.
+        :else
+        nil))))
+
+(defn unify-equations
+  "Unifies each equation into the substitutions, which are returned. If any
+   equation can't be unified, everything unified by the others is undone and
+   nil is returned."
+  ([equations]
+   (unify-equations equations (new-substitutions)))
+  ([equations substitutions]
+   (let [start (mark substitutions)]
+     (or (reduce (fn [acc [left right]]
+                   (if-some [new-acc (unify left right acc)]
+                     new-acc
+                     (reduced nil)))
+                 substitutions
+                 equations)
+         (do
+           (rollback! substitutions start)
+           nil)))))
+
+(defn apply-substitutions
+  "Returns the type with every variable within it replaced by what it's
+   bound to, as far as that's known."
+  [typ substitutions]
+  (when (some? substitutions)
+    (let [typ (prune typ substitutions)]
+      (if (= ::function (::type-kind typ))
+        (-> typ
+            (update ::return-type apply-substitutions substitutions)
+            ; Eagerly, since later unification would change a lazy result.
+            (update ::parameter-types (fn [param-types]
+                                        (mapv #(apply-substitutions % substitutions) param-types))))
+        typ))))
 
 (defn render-type
   [typ]
@@ -399,6 +583,112 @@
           ret (render-type (::return-type typ))]
       (str "((" (clojure.string/join ", " params) ") -> " ret ")"))))
 
+(defn numeric-result-type
+  "Determines the type returned by a numeric prelude fn, given its argument
+   types. This follows C++'s arithmetic promotion, as the runtime does."
+  [arg-types]
+  (when (and (not-empty arg-types)
+             (every? #(and (= ::single (::type-kind %))
+                           (contains? #{"integer" "real"} (::name %)))
+                     arg-types))
+    {::type-kind ::single
+     ::name (if (some #(= "real" (::name %)) arg-types)
+              "real"
+              "integer")}))
+
+(defn numeric-application? [expression]
+  (and (= :application (::parse.spec/kind expression))
+       (-> expression ::parse.spec/value ::prelude?)
+       (contains? numeric-fns (-> expression ::parse.spec/value ::parse.spec/name))))
+
+(defn numeric-applications
+  "The numeric applications within the expression, each after those within
+   its arguments, so that nested arithmetic can be solved in one pass."
+  ([expression]
+   (numeric-applications [] expression))
+  ([found node]
+   (cond
+     (map? node)
+     (cond-> (reduce numeric-applications found (vals node))
+       (numeric-application? node) (conj node))
+
+     (coll? node)
+     (reduce numeric-applications found node)
+
+     :else
+     found)))
+
+(defn solve-numeric-application!
+  "Unifies the application's type with its numeric result, if its argument
+   types are known. Returns whether or not there's nothing left to do for it;
+   a result which contradicts what's already been unified is left unsolved."
+  [application substitutions]
+  (let [arg-types (mapv #(apply-substitutions (::type %) substitutions)
+                        (::parse.spec/arguments application))]
+    (if-some [result (numeric-result-type arg-types)]
+      (do
+        (unify-equations [[(::type application) result]] substitutions)
+        true)
+      false)))
+
+(defn solve-numeric
+  "Numeric results depend on argument types, so they can't be known until the
+   arguments are unified. Each solved result may resolve more arguments, so
+   the applications which couldn't be solved are tried again until nothing
+   changes."
+  [expression substitutions]
+  (loop [pending (numeric-applications expression)]
+    (let [unsolved (filterv #(not (solve-numeric-application! % substitutions)) pending)]
+      (when (< (count unsolved) (count pending))
+        (recur unsolved))))
+  substitutions)
+
+(defn resolve-types
+  "Replaces the type of every node in the expression with its solution."
+  [expression substitutions]
+  (postwalk (fn [node]
+              (if (and (map? node)
+                       (contains? node ::parse.spec/kind)
+                       (contains? node ::type))
+                (update node ::type apply-substitutions substitutions)
+                node))
+            expression))
+
+(defn infer-form
+  "Infers the types of one top-level expression, given the scope which the
+   expressions before it left, and the substitutions they unified, which are
+   shared. Its types are resolved as soon as it's unified, so later
+   expressions can't change them. When it can't be unified, what it unified
+   is undone, so its types are left unsolved and it's treated as dynamically
+   typed. Returns the typed expression, along with the new scope and what was
+   written to the substitutions."
+  [expression scope substitutions]
+  (let [res (assign-typenames expression scope [])
+        expression (::expression res)
+        equations (generate-equations expression [] (::scope res))
+        _ (some->> (unify-equations equations substitutions)
+                   (solve-numeric expression))
+        resolved (resolve-types expression substitutions)
+        writes (trail-writes substitutions)]
+    (commit! substitutions)
+    {::expression resolved
+     ::scope (::scope res)
+     ::writes writes}))
+
+(defn infer
+  "Infers the types of each top-level expression, in order; see infer-form."
+  [expressions]
+  (let [substitutions (new-substitutions)]
+    (loop [expressions expressions
+           scope {}
+           typed []]
+      (if (empty? expressions)
+        typed
+        (let [res (infer-form (first expressions) scope substitutions)]
+          (recur (rest expressions)
+                 (::scope res)
+                 (conj typed (::expression res))))))))
+
 (comment
   (render-type {::type-kind ::function
                 ::parameter-types [{::type-kind ::single
@@ -4,11 +4,15 @@
             [orchestra.core :refer [defn-spec]]
             [com.jeaye.jank
              [log :refer [pprint]]
-             [assert :refer [incomplete-parse!]]]
+             [cache :as cache]]
             [com.jeaye.jank.parse
              [binding :as parse.binding]
+             [reader :as parse.reader]
              [transform :as parse.transform]]))
 
+; The grammar is the reference for jank's syntax, and the dev tools use it to
+; look for ambiguities, but compiling goes through parse.reader, which reads
+; the same tree much faster.
 (insta/defparser whitespace-or-comments-parser
   (clojure.java.io/resource "neo-whitespace-grammar"))
 
@@ -17,34 +21,135 @@
   :auto-whitespace whitespace-or-comments-parser
   :output-format :enlive)
 
-(defn add-meta [input parsed]
-  (insta/add-line-and-column-info-to-metadata input parsed))
-
 (defn parse
-  "Runs the provided resource file through instaparse and transforms from hiccup
-   to hickory. Returns the generated syntax tree."
+  "Reads the input source and transforms from enlive to hickory. Returns the
+   generated syntax tree."
   [prelude]
   ;(pprint "parsing" input)
   ; TODO: Assert that the proper bindings are present
-   (let [input parse.binding/*input-source*
-         parsed (parser input)
-         ;_ (pprint "raw parsed" parsed)
-         _ (when (insta/failure? parsed)
-             (incomplete-parse! (insta/get-failure parsed)))
-         parsed-with-meta (add-meta input parsed)
-         ;_ (pprint "parsed" parsed-with-meta)
-         transformed (parse.transform/walk parsed-with-meta)]
+   (let [parsed (parse.reader/read-source parse.binding/*input-source*)
+         ;_ (pprint "parsed" parsed)
+         transformed (parse.transform/walk parsed)]
      ;(pprint "transformed" transformed)
      (into prelude transformed)))
 
 (defn parses [source & args]
   (apply insta/parses parser source args))
 
+(defn string-end
+  "Returns the index just past the string which starts at i, or nil if it's
+   never closed."
+  [^String source i]
+  (loop [i (inc i)]
+    (when (< i (count source))
+      (case (.charAt source i)
+        \\ (recur (+ i 2))
+        \" (inc i)
+        (recur (inc i))))))
+
+(defn line-end [^String source i]
+  (let [newline (.indexOf source "\n" (int i))]
+    (if (neg? newline)
+      (count source)
+      newline)))
+
+(defn atom-end? [c]
+  (or (Character/isWhitespace (char c))
+      (contains? #{\( \) \[ \] \{ \} \" \;} c)))
+
+(defn top-level-forms
+  "Splits the source into the [start end] spans of its top-level forms,
+   skipping the whitespace and comments between them. Returns nil if the
+   delimiters aren't balanced. This only needs to find where forms start and
+   end; anything else which is wrong is left for the parser."
+  [^String source]
+  (let [n (count source)]
+    (loop [i 0
+           depth 0
+           start nil
+           spans []]
+      (cond
+        ; Atoms, like numbers and identifiers, end at anything which can't be
+        ; within them.
+        (and (some? start) (zero? depth) (< start i)
+             (or (= i n) (atom-end? (.charAt source i))))
+        (recur i 0 nil (conj spans [start i]))
+
+        (= i n)
+        (when (nil? start)
+          spans)
+
+        :else
+        (let [c (.charAt source i)
+              regex? (and (= \# c) (< (inc i) n) (= \" (.charAt source (inc i))))
+              set? (and (= \# c) (< (inc i) n) (= \{ (.charAt source (inc i))))]
+          (cond
+            (Character/isWhitespace c)
+            (recur (inc i) depth start spans)
+
+            (= \; c)
+            (recur (long (line-end source i)) depth start spans)
+
+            (or (= \" c) regex?)
+            (when-some [end (string-end source (if regex? (inc i) i))]
+              (if (zero? depth)
+                (recur (long end) 0 nil (conj spans [i end]))
+                (recur (long end) depth start spans)))
+
+            (or (contains? #{\( \[ \{} c) set?)
+            (recur (if set? (+ i 2) (inc i)) (inc depth) (or start i) spans)
+
+            (contains? #{\) \] \}} c)
+            (case depth
+              0 nil
+              1 (recur (inc i) 0 nil (conj spans [start (inc i)]))
+              (recur (inc i) (dec depth) start spans))
+
+            :else
+            (recur (inc i) depth (or start i) spans)))))))
+
+(def form-resources
+  "Everything which goes into parsing a form."
+  ["com/jeaye/jank/parse.clj"
+   "com/jeaye/jank/parse/reader.clj"
+   "com/jeaye/jank/parse/spec.clj"
+   "com/jeaye/jank/parse/transform.clj"])
+(def form-fingerprint (delay (cache/fingerprint form-resources)))
+
+(defn parse-form
+  "Parses the source of one top-level form, or returns nil if it can't be
+   parsed. Errors aren't reported, since they wouldn't point into the
+   whole source."
+  [form-source]
+  (cache/lookup "forms"
+                (some->> @form-fingerprint (vector form-source) cache/digest)
+                #(binding [parse.binding/*input-source* form-source
+                           *out* (java.io.StringWriter.)]
+                   (try
+                     (parse [])
+                     (catch clojure.lang.ExceptionInfo _
+                       nil)))))
+
+(defn parse-forms
+  "Like parse, but each top-level form is parsed on its own and cached on
+   disk, keyed by its source, so only new or changed forms are parsed again.
+   If any form can't be parsed on its own, the whole source is parsed at
+   once, so errors are reported just as they are without the cache."
+  [prelude]
+  (let [source parse.binding/*input-source*
+        forms (reduce (fn [forms [start end]]
+                        (if-some [parsed (parse-form (subs source start end))]
+                          (into forms parsed)
+                          (reduced nil)))
+                      prelude
+                      (or (top-level-forms source) [[0 (count source)]]))]
+    (or forms (parse prelude))))
+
 (def prelude-file "neo-prelude.jank")
 (def prelude (binding [parse.binding/*input-file* prelude-file
                        parse.binding/*input-source* (-> (io/resource prelude-file)
                                                         slurp)]
-               (parse [])))
+               (parse-forms [])))
 
 (comment
   (binding [parse.binding/*input-file* "repl"
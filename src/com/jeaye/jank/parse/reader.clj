@@ -0,0 +1,240 @@
+(ns com.jeaye.jank.parse.reader
+  (:require [com.jeaye.jank.assert :refer [incomplete-parse!]]))
+
+; A hand-written reader for jank source, which reads each form in a single
+; pass, without backtracking. It produces the same tree which instaparse
+; produced from neo-grammar, tags, content, and position metadata alike, so
+; the transform and error reporting are unchanged. Unlike the grammar, which
+; could match a keyword like def or true at the start of a longer name,
+; tokens always run until a delimiter, as they do in Clojure.
+
+(defn line-starts
+  "The index at which each line starts."
+  ^longs [^String source]
+  (loop [i 0
+         starts (transient [0])]
+    (let [newline (.indexOf source "\n" (int i))]
+      (if (neg? newline)
+        (long-array (persistent! starts))
+        (recur (inc newline) (conj! starts (inc newline)))))))
+
+(defn position
+  "The line and column of the index, both from 1, as instaparse has them."
+  [^longs starts index]
+  (let [found (java.util.Arrays/binarySearch starts (long index))
+        line (if (neg? found)
+               (- (- found) 2)
+               found)]
+    [(inc line) (inc (- index (aget starts line)))]))
+
+(defn node [{:keys [starts]} tag content start end]
+  (let [[start-line start-column] (position starts start)
+        [end-line end-column] (position starts end)]
+    (with-meta {:tag tag
+                :content content}
+               {:instaparse.gll/start-index start
+                :instaparse.gll/end-index end
+                :instaparse.gll/start-line start-line
+                :instaparse.gll/start-column start-column
+                :instaparse.gll/end-line end-line
+                :instaparse.gll/end-column end-column})))
+
+(defn fail! [{:keys [starts]} index]
+  (let [[line column] (position starts index)]
+    (incomplete-parse! {:index index
+                        :line line
+                        :column column})))
+
+(defn whitespace?
+  "Whether the char is whitespace, as \\s is in the grammar."
+  [c]
+  (case c
+    (\space \tab \newline \return \formfeed \u000B) true
+    false))
+
+(defn delimiter? [c]
+  (or (whitespace? c)
+      (case c
+        (\( \) \[ \] \{ \} \" \;) true
+        false)))
+
+(defn skip-space
+  "The index of the next form, after any whitespace and comments, or the end
+   of the source."
+  [^String source i]
+  (let [n (count source)]
+    (loop [i (long i)]
+      (if (< i n)
+        (let [c (.charAt source i)]
+          (cond
+            (whitespace? c) (recur (inc i))
+            (= \; c) (let [newline (.indexOf source "\n" (int i))]
+                       (if (neg? newline)
+                         n
+                         (recur (inc newline))))
+            :else i))
+        n))))
+
+(defn token-end [^String source i]
+  (let [n (count source)]
+    (loop [i (long i)]
+      (if (and (< i n) (not (delimiter? (.charAt source i))))
+        (recur (inc i))
+        i))))
+
+(defn string-end
+  "The index of the quote which closes the string whose text starts at i,
+   or nil if it's never closed."
+  [^String source i]
+  (let [n (count source)]
+    (loop [i (long i)]
+      (when (< i n)
+        (case (.charAt source i)
+          \\ (recur (+ i 2))
+          \" i
+          (recur (inc i)))))))
+
+; Tokens never contain whitespace or delimiters, so these only need to rule
+; out what the grammar's terminals rule out beyond those.
+(def integer-pattern #"[+-]?\d+")
+(def real-pattern #"[+-]?\d+\.\d*")
+(def qualified-keyword-pattern #"(::?)([^/:]+)/([^/:]+)")
+(def keyword-pattern #"(::?)([^/:]+)")
+(def qualified-identifier-pattern #"([^\d:/#][^/#]*)/([^\d:/.#][^/.#]*)")
+(def identifier-pattern #"[^\d:/.#][^/.#]*")
+
+(defn token->content
+  "The tag and content of the token, as the grammar parses it, or nil if it
+   isn't valid. Numbers come before identifiers, so +1 is a number."
+  [token]
+  (cond
+    (= "nil" token) [:nil []]
+    (or (= "true" token) (= "false" token)) [:boolean [token]]
+    (re-matches integer-pattern token) [:integer [token]]
+    (re-matches real-pattern token) [:real [token]]
+    :else
+    (or (when-some [[_ colons ns name] (re-matches qualified-keyword-pattern token)]
+          [:qualified-keyword [colons ns "/" name]])
+        (when-some [[_ colons name] (re-matches keyword-pattern token)]
+          [:keyword [colons name]])
+        (when-some [[_ ns name] (re-matches qualified-identifier-pattern token)]
+          [:qualified-identifier [ns name]])
+        (when (re-matches identifier-pattern token)
+          [:identifier [token]]))))
+
+(def special-forms
+  "Lists which start with one of these names are special forms, rather than
+   applications."
+  {"def" :def
+   "fn" :fn
+   "do" :do
+   "if" :if
+   "let" :let
+   "loop" :loop
+   "recur" :recur})
+
+(defn identifier? [form]
+  (= :identifier (:tag form)))
+
+(defn identifiers? [form]
+  (and (= :vector (:tag form))
+       (every? identifier? (:content form))))
+
+(defn bindings? [form]
+  (and (= :vector (:tag form))
+       (even? (count (:content form)))
+       (every? identifier? (take-nth 2 (:content form)))))
+
+(defn special-content
+  "The content of a special form, given what follows its name, with binding
+   and parameter vectors tagged as the grammar tags them, or nil if it's not
+   valid."
+  [special [first-arg second-arg :as args]]
+  (case special
+    :def (when (and (= 2 (count args)) (identifier? first-arg))
+           args)
+    :fn (cond
+          (and (identifier? first-arg) (identifiers? second-arg))
+          (assoc args 1 (assoc second-arg :tag :argument-list))
+          (identifiers? first-arg)
+          (assoc args 0 (assoc first-arg :tag :argument-list)))
+    :if (when (<= 2 (count args) 3)
+          args)
+    (:let :loop) (when (bindings? first-arg)
+                   (assoc args 0 (assoc first-arg :tag :let-bindings)))
+    (:do :recur) args))
+
+(declare read-form)
+
+(defn read-forms
+  "Reads forms up to the closing delimiter. Returns them, along with the
+   index just past the delimiter."
+  [{:keys [^String source] :as context} i close]
+  (let [n (count source)]
+    (loop [i (long (skip-space source i))
+           forms []]
+      (cond
+        (= i n) (fail! context n)
+        (= close (.charAt source i)) [forms (inc i)]
+        :else (let [[form end] (read-form context i)]
+                (recur (long (skip-space source end)) (conj forms form)))))))
+
+(defn read-list [context i]
+  (let [[forms end] (read-forms context (inc i) \))
+        head (first forms)
+        special (when (identifier? head)
+                  (special-forms (first (:content head))))
+        content (if (some? special)
+                  (special-content special (subvec forms 1))
+                  (not-empty forms))]
+    (when (nil? content)
+      (fail! context i))
+    [(node context (or special :application) content i end) end]))
+
+(defn read-string-like
+  "Reads a string, or a regex, whose text starts at text-start."
+  [{:keys [^String source] :as context} tag i text-start]
+  (if-some [close (string-end source text-start)]
+    [(node context tag [(subs source text-start close)] i (inc close)) (inc close)]
+    (fail! context (count source))))
+
+(defn read-collection [context tag i text-start close]
+  (let [[forms end] (read-forms context text-start close)]
+    [(node context tag forms i end) end]))
+
+(defn read-form
+  "Reads the form at i, which isn't whitespace. Returns it, along with the
+   index just past it."
+  [{:keys [^String source] :as context} i]
+  (let [c (.charAt source (int i))
+        next-c (when (< (inc i) (count source))
+                 (.charAt source (int (inc i))))]
+    (case c
+      \( (read-list context i)
+      \[ (read-collection context :vector i (inc i) \])
+      \{ (read-collection context :map i (inc i) \})
+      \" (read-string-like context :string i (inc i))
+      \# (case next-c
+           \{ (read-collection context :set i (+ i 2) \})
+           \" (read-string-like context :regex i (+ i 2))
+           (fail! context i))
+      (\) \] \}) (fail! context i)
+      (let [end (token-end source i)]
+        (if-some [[tag content] (token->content (subs source i end))]
+          [(node context tag content i end) end]
+          (fail! context i))))))
+
+(defn read-source
+  "Reads every top-level form in the source into the tree which instaparse
+   would have produced. Errors are reported against
+   parse.binding/*input-source*, so that should be the source."
+  [^String source]
+  (let [context {:source source
+                 :starts (line-starts source)}
+        n (count source)]
+    (loop [i (long (skip-space source 0))
+           forms []]
+      (if (= i n)
+        forms
+        (let [[form end] (read-form context i)]
+          (recur (long (skip-space source end)) (conj forms form)))))))
@@ -29,6 +29,8 @@
                            :do
                            :if
                            :let
+                           :loop
+                           :recur
                            :application]))
 
 (defmacro node [& specs]
@@ -76,6 +78,7 @@
                  ::fn ; The name of a fn.
                  ::parameter ; Inputs bound to a fn.
                  ::let ; Bound to the body of the let.
+                 ::loop ; Bound to the body of the loop, and rebound by recur.
                  })
 (s/def ::binding (s/keys :req [::identifier
                                ::scope]
@@ -99,9 +102,14 @@
 
 (s/def ::let any?) ; TODO:
 
+(s/def ::bindings (s/coll-of any?)) ; TODO: binding
+(s/def ::loop (s/keys :req [::bindings
+                            ::body])) ; TODO: do
+
 (s/def ::arguments any?) ; TODO: coll-of ::node
 (s/def ::application (s/keys :req [::value
                                    ::arguments]))
+(s/def ::recur (s/keys :req [::arguments]))
 
 (s/def ::node (s/or :nil (node (constant? :nil))
                     :integer (node (constant? :integer) (single? integer?))
@@ -125,5 +133,9 @@
                               ::if)
                     :let (node (kind? :let)
                                ::let)
+                    :loop (node (kind? :loop)
+                                ::loop)
+                    :recur (node (kind? :recur)
+                                 ::recur)
                     :application (node (kind? :application)
                                        ::application)))
@@ -97,8 +97,42 @@
                            ret
                            (constant none :nil))}))
 
+(defn target-recurs
+  "All recurs within the expression which target the enclosing loop or fn.
+   Nested fns and loop bodies are their own targets, but a loop's bindings
+   are evaluated before it starts."
+  [expression]
+  (->> (tree-seq coll?
+                 #(cond
+                    (not (map? %)) %
+                    (= :fn (::parse.spec/kind %)) []
+                    (= :loop (::parse.spec/kind %)) (::parse.spec/bindings %)
+                    :else (vals %))
+                 expression)
+       (filter #(and (map? %) (= :recur (::parse.spec/kind %))))))
+
+(defn tail-recurs
+  "The recurs within the expression which are in tail position, so nothing
+   else is evaluated after them."
+  [expression]
+  (case (::parse.spec/kind expression)
+    :recur [expression]
+    :do (recur (::parse.spec/return expression))
+    :let (recur (::parse.spec/body expression))
+    :if (mapcat tail-recurs (keep expression [::parse.spec/then ::parse.spec/else]))
+    []))
+
+(defn assert-recurs! [body arity]
+  (let [tail (tail-recurs body)]
+    (parse-assert! (= (count (target-recurs body)) (count tail))
+                   parse.binding/*current-form*
+                   "recur can only be in tail position")
+    (parse-assert! (every? #(= arity (count (::parse.spec/arguments %))) tail)
+                   parse.binding/*current-form*
+                   "recur requires " arity " arguments")))
+
 (deftransform fn-expression [& more]
-  (let [has-name? (= :identifier (-> more first :kind))
+  (let [has-name? (= :identifier (-> more first ::parse.spec/kind))
         ; TODO: Add parse support for variadic fns
         params (mapv (fn [ident]
                        {::parse.spec/kind :binding
@@ -107,12 +141,13 @@
                      (if has-name?
                        (second more)
                        (first more)))
-        body (if has-name?
-               (drop 2 more)
-               (rest more))]
+        body (apply do-expression (if has-name?
+                                    (drop 2 more)
+                                    (rest more)))]
+    (assert-recurs! body (count params))
     (merge {::parse.spec/kind :fn
             ::parse.spec/parameters params
-            ::parse.spec/body (apply do-expression body)}
+            ::parse.spec/body body}
            (when has-name?
              {::parse.spec/name {::parse.spec/kind :binding
                                  ::parse.spec/identifier (first more)
@@ -138,6 +173,17 @@
    ::parse.spec/bindings bindings
    ::parse.spec/body (apply do-expression body)})
 
+(deftransform loop-expression [bindings & body]
+  (let [body (apply do-expression body)]
+    (assert-recurs! body (count bindings))
+    {::parse.spec/kind :loop
+     ::parse.spec/bindings (mapv #(assoc % ::parse.spec/scope ::parse.spec/loop) bindings)
+     ::parse.spec/body body}))
+
+(deftransform recur-expression [& arguments]
+  {::parse.spec/kind :recur
+   ::parse.spec/arguments (vec arguments)})
+
 (deftransform application [& more]
   {::parse.spec/kind :application
    ::parse.spec/value (first more)
@@ -164,17 +210,26 @@
                   :if if-expression
                   :let let-expression
                   :let-bindings let-bindings
+                  :loop loop-expression
+                  :recur recur-expression
                   :application application})
 
 (defn-spec walk ::parse.spec/tree
   [parsed any?]
-  (postwalk (fn [item]
-              ;(pprint "walk item" [item (meta item)])
-              (if-some [trans (when (and (map? item) (contains? item :tag))
-                                (transformer (:tag item)))]
-                (let [r (binding [parse.binding/*current-form* item]
-                          (apply trans (:content item)))]
-                  ;(pprint [r (meta r)])
-                  r)
-                item))
-                 parsed))
+  (let [transformed (postwalk (fn [item]
+                                ;(pprint "walk item" [item (meta item)])
+                                (if-some [trans (when (and (map? item) (contains? item :tag))
+                                                  (transformer (:tag item)))]
+                                  (let [r (binding [parse.binding/*current-form* item]
+                                            (apply trans (:content item)))]
+                                    ;(pprint [r (meta r)])
+                                    r)
+                                  item))
+                              parsed)]
+    ; Transformed forms don't keep their source positions, so errors are
+    ; reported against the parsed forms.
+    (doseq [[form expression] (map vector parsed transformed)]
+      (parse-assert! (empty? (target-recurs expression))
+                     form
+                     "recur can only be within a loop or fn"))
+    transformed))